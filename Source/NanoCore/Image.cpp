@@ -218,6 +218,19 @@ bool Image::Load( const wchar_t * name ) {
 	return false;
 }
 
+float * Image::LoadFloat( const wchar_t * name, int & w, int & h ) {
+	int n;
+	std::string file = StrWcsToMbs( name );
+	float * data = stbi_loadf( file.c_str(), &w, &h, &n, 3 );
+	if( !data )
+		return NULL;
+
+	float * pixels = new float[w*h*3];
+	memcpy( pixels, data, w*h*3*sizeof(float) );
+	stbi_image_free( data );
+	return pixels;
+}
+
 void Image::Clear() {
 	delete[] m_pBuffer;
 	m_pBuffer = NULL;
@@ -38,6 +38,8 @@ public:
 	void GetPixelBilinear( float u, float v, int * pix ) const;
 
 	bool Load( const wchar_t * name );
+	// linear RGB of an HDR file, 3 floats per pixel, NULL on failure, the caller delete[]s it
+	static float * LoadFloat( const wchar_t * name, int & w, int & h );
 	int  WriteAsBMP( const wchar_t * name );
 
 	static void LerpColor( int * result, const int * c0, const int * c1, int coef1k, int bpp );
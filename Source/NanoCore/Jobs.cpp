@@ -3,8 +3,6 @@
 #include <vector>
 #include <deque>
 
-#define MAX_THREADS 32
-
 //#define Log NanoCore::DebugOutput
 #define Log
 
@@ -16,12 +14,20 @@ namespace NanoCore {
 
 class WorkerThread : public Thread {
 public:
-	WorkerThread() : m_job(NULL) {}
+	WorkerThread( int index, uint64 affinityMask, int node ) : m_job(NULL), m_index(index), m_affinityMask(affinityMask), m_node(node), m_numJobs(0) {}
 
 	virtual void Run( void* );
 
+	int    GetNode() const { return m_node; }
+	uint64 GetNumJobs() const { return m_numJobs; }
+	void   ResetNumJobs() { m_numJobs = 0; }
+
 private:
 	IJob * m_job;
+	int    m_index;
+	uint64 m_affinityMask;
+	int    m_node;
+	volatile uint64 m_numJobs;
 };
 
 
@@ -30,21 +36,29 @@ private:
 void   AddImmediateJobs( IJob ** p, int count );
 IJob * GetSingleJob();
 void   ClearPending();
+void   ClearPending( int firstType, int numTypes );
+void   DecJobType( int type );
 
 static volatile int32 s_jobsCount;
 static volatile bool  s_bEnableJobs = true;
 static volatile int32 s_numJobs = 0;
 
 static CriticalSection            s_csAvailable;
-static std::deque<IJob*>          s_available;
+static std::deque<IJob*>          s_available[IJob::ePriorityCount];
 static std::vector<WorkerThread*> s_threads;
 static int                        s_maxTypes;
+static int                        s_numNodes = 1;
+static JobManager::EAffinity      s_affinity = JobManager::eAffinityNone;
+static __declspec(thread) int     s_currentNode = 0;
+static __declspec(thread) int     s_currentThreadIndex = -1;
+static __declspec(thread) int     s_currentJobType = -1;
 
 struct JobType {
 	volatile int32 count;
+	volatile bool bDisabled;  // no job of the type is added while its pending jobs are cleared
 	std::vector<IJob*> dependant_jobs;
 	CriticalSection cs;
-	JobType() : count(0) {}
+	JobType() : count(0), bDisabled(false) {}
 };
 static JobType * s_pJobTypes;
 
@@ -54,7 +68,15 @@ void IJob::SetType( int type ) {
 	m_type = type;
 }
 
+void IJob::SetPriority( EPriority priority ) {
+	m_priority = priority;
+}
+
 void WorkerThread::Run( void* ) {
+	SetCurrentThreadAffinity( m_affinityMask );
+	s_currentNode = m_node;
+	s_currentThreadIndex = m_index;
+
 	Log( "Worker thread %ls started.\n", GetName() );
 	for( ;; ) {
 		IJob * pJob = GetSingleJob();
@@ -65,45 +87,77 @@ void WorkerThread::Run( void* ) {
 			continue;
 		}
 		m_job = pJob;
+		s_currentJobType = pJob->GetType();
 		pJob->Execute();
+		s_currentJobType = -1;
 
 		AtomicInc( &s_numJobs );
+		m_numJobs++;
 
-		const int type = pJob->GetType();
-		JobType * ptr = &s_pJobTypes[type];
-
-		{
-			int32 ret = AtomicDec( &ptr->count );
-			if( ret == 0 ) {
-				csScope cs( ptr->cs );
-				const int jc = (int)ptr->dependant_jobs.size();
-				if( jc ) {
-					AddImmediateJobs( &ptr->dependant_jobs[0], jc );
-					ptr->dependant_jobs.clear();
-				}
-			}
-		}
+		DecJobType( pJob->GetType() );
 		AtomicDec( &s_jobsCount );
 	}
 }
 
-void JobManager::Init( int numThreads, int maxTypes ) {
+// the last job of the type releases the jobs waiting for it
+void DecJobType( int type ) {
+	JobType * ptr = &s_pJobTypes[type];
+	int32 ret = AtomicDec( &ptr->count );
+	if( ret == 0 ) {
+		csScope cs( ptr->cs );
+		const int jc = (int)ptr->dependant_jobs.size();
+		if( jc ) {
+			AddImmediateJobs( &ptr->dependant_jobs[0], jc );
+			ptr->dependant_jobs.clear();
+		}
+	}
+}
+
+static int FindNode( uint64 mask ) {
+	for( int node=0; node<s_numNodes; ++node )
+		if( GetNumaNodeProcessorMask( node ) & mask )
+			return node;
+	return 0;
+}
+
+void JobManager::Init( int numThreads, int maxTypes, EAffinity affinity ) {
 	if( s_pJobTypes )
 		delete[] s_pJobTypes;
 	s_pJobTypes = new JobType[maxTypes];
 	s_maxTypes = maxTypes;
 	s_bEnableJobs = true;
 
+	SystemInfo si;
+	GetSystemInfo( &si );
+
 	if( numThreads <= 0 ) {
-		SystemInfo si;
-		GetSystemInfo( &si );
 		numThreads = (numThreads == 0) ? si.ProcessorCount-1 : si.ProcessorCount;
 	} else if( numThreads > MAX_THREADS ) {
 		numThreads = MAX_THREADS;
 		// warning
 	}
+
+	s_affinity = affinity;
+	s_numNodes = (affinity == eAffinityNone) ? 1 : si.NumaNodeCount;
+
 	for( int i=0; i<numThreads; ++i ) {
-		WorkerThread * p = new WorkerThread();
+		uint64 mask = 0;
+		int node = 0;
+		switch( affinity ) {
+			case eAffinityCore:
+				mask = uint64(1) << (i % Min( si.ProcessorCount, 64 ));
+				node = FindNode( mask );
+				break;
+			case eAffinitySMT:
+				mask = GetCoreProcessorMask( i % si.CoreCount );
+				node = FindNode( mask );
+				break;
+			case eAffinityNumaNode:
+				node = i % s_numNodes;
+				mask = GetNumaNodeProcessorMask( node );
+				break;
+		}
+		WorkerThread * p = new WorkerThread( i, mask, node );
 
 		wchar_t buf[64];
 		swprintf_s( buf, L"jmThread %d", i );
@@ -120,13 +174,14 @@ void JobManager::Done() {
 	s_threads.clear();
 	delete[] s_pJobTypes;
 	s_pJobTypes = NULL;
-	s_available.clear();
+	for( int i=0; i<IJob::ePriorityCount; ++i )
+		s_available[i].clear();
 }
 
 void JobManager::AddJob( IJob * pJob, int typeToWait ) {
-	if( !s_bEnableJobs )
-		return;
 	JobType * pJobType = s_pJobTypes + pJob->GetType();
+	if( !s_bEnableJobs || pJobType->bDisabled )
+		return;
 
 	AtomicInc( &pJobType->count );
 	AtomicInc( &s_jobsCount );
@@ -146,21 +201,32 @@ bool JobManager::IsRunning() {
 	return s_jobsCount > 0;
 }
 
+bool JobManager::IsRunning( int firstType, int numTypes ) {
+	for( int i=firstType; i<firstType+numTypes; ++i )
+		if( s_pJobTypes[i].count > 0 )
+			return true;
+	return false;
+}
+
 void AddImmediateJobs( IJob ** p, int count ) {
 	csScope cs( s_csAvailable );
 	for( int i=0; i<count; ++i )
-		s_available.push_back( p[i] );
+		s_available[ p[i]->GetPriority() ].push_back( p[i] );
 	for( int i=0, n=(int)s_threads.size(); i<n; ++i )
 		s_threads[i]->Resume();
 }
 
 IJob * GetSingleJob() {
 	csScope cs( s_csAvailable );
-	if( s_available.empty())
-		return NULL;
-	IJob * p = s_available.front();
-	s_available.pop_front();
-	return p;
+	for( int i=0; i<IJob::ePriorityCount; ++i ) {
+		std::deque<IJob*> & lane = s_available[i];
+		if( !lane.empty()) {
+			IJob * p = lane.front();
+			lane.pop_front();
+			return p;
+		}
+	}
+	return NULL;
 }
 
 void ClearPending() {
@@ -170,10 +236,48 @@ void ClearPending() {
 		s_pJobTypes[i].count = 0;
 	}
 	csScope cs( s_csAvailable );
-	s_available.clear();
+	for( int i=0; i<IJob::ePriorityCount; ++i )
+		s_available[i].clear();
 	s_jobsCount = 0;
 }
 
+static bool IsInRange( IJob * pJob, int firstType, int numTypes ) {
+	return pJob->GetType() >= firstType && pJob->GetType() < firstType + numTypes;
+}
+
+// the jobs waiting for a type are taken before the available ones, so a job released in between is still found
+void ClearPending( int firstType, int numTypes ) {
+	std::vector<IJob*> removed;
+	for( int i=0; i<s_maxTypes; ++i ) {
+		csScope cs( s_pJobTypes[i].cs );
+		std::vector<IJob*> & jobs = s_pJobTypes[i].dependant_jobs;
+		size_t kept = 0;
+		for( size_t j=0; j<jobs.size(); ++j )
+			if( IsInRange( jobs[j], firstType, numTypes ))
+				removed.push_back( jobs[j] );
+			else
+				jobs[kept++] = jobs[j];
+		jobs.resize( kept );
+	}
+	{
+		csScope cs( s_csAvailable );
+		for( int i=0; i<IJob::ePriorityCount; ++i ) {
+			std::deque<IJob*> & lane = s_available[i];
+			size_t kept = 0;
+			for( size_t j=0; j<lane.size(); ++j )
+				if( IsInRange( lane[j], firstType, numTypes ))
+					removed.push_back( lane[j] );
+				else
+					lane[kept++] = lane[j];
+			lane.resize( kept );
+		}
+	}
+	for( size_t i=0; i<removed.size(); ++i ) {
+		DecJobType( removed[i]->GetType() );
+		AtomicDec( &s_jobsCount );
+	}
+}
+
 void JobManager::Wait( int flags ) {
 
 	if( flags & efDisableJobAddition )
@@ -199,12 +303,51 @@ void JobManager::Wait( int flags ) {
 	s_bEnableJobs = true;
 }
 
+// a running job may still add jobs of the types before it finishes, so the pending ones are cleared until none is left
+void JobManager::Wait( int flags, int firstType, int numTypes ) {
+	if( flags & efDisableJobAddition )
+		for( int i=firstType; i<firstType+numTypes; ++i )
+			s_pJobTypes[i].bDisabled = true;
+
+	for( ;; ) {
+		if( flags & efClearPendingJobs )
+			ClearPending( firstType, numTypes );
+		if( !IsRunning( firstType, numTypes ))
+			break;
+		Sleep( 1 );
+	}
+	for( int i=firstType; i<firstType+numTypes; ++i )
+		s_pJobTypes[i].bDisabled = false;
+}
+
 int JobManager::GetNumThreads() {
 	return (int)s_threads.size();
 }
 
-void JobManager::ResetStats() {
+int JobManager::GetNumNodes() {
+	return s_numNodes;
+}
+
+int JobManager::GetCurrentThreadNode() {
+	return s_currentNode;
+}
 
+int JobManager::GetCurrentThreadIndex() {
+	return s_currentThreadIndex;
+}
+
+int JobManager::GetCurrentJobType() {
+	return s_currentJobType;
+}
+
+JobManager::EAffinity JobManager::GetAffinity() {
+	return s_affinity;
+}
+
+void JobManager::ResetStats() {
+	s_numJobs = 0;
+	for( size_t i=0; i<s_threads.size(); ++i )
+		s_threads[i]->ResetNumJobs();
 }
 
 uint64 JobManager::GetStats( EStats stats ) {
@@ -233,12 +376,32 @@ uint64 JobManager::GetStats( EStats stats ) {
 	return 0;
 }
 
+uint64 JobManager::GetNodeStats( int node, EStats stats ) {
+	uint64 t = 0;
+	for( size_t i=0; i<s_threads.size(); ++i ) {
+		const WorkerThread * p = s_threads[i];
+		if( p->GetNode() != node )
+			continue;
+		switch( stats ) {
+			case eNumThreads: t++; break;
+			case eNumJobs: t += p->GetNumJobs(); break;
+			case eThreadIdleTime: t += p->GetIdleTicks(); break;
+			case eThreadWorkTime: t += p->GetWorkTicks(); break;
+		}
+	}
+	return t;
+}
+
 void JobManager::PrintStats() {
 	DebugOutput( "Job manager CS wait: %ld us\n", TickToMicroseconds( s_csAvailable.GetWaitTicks( CriticalSection::eTotal )));
 	uint64 u = 0;
 	for( int i=0; i<s_maxTypes; ++i )
 		u += s_pJobTypes[i].cs.GetWaitTicks( CriticalSection::eTotal );
 	DebugOutput( "Job frame CS wait: %ld us\n", u );
+	for( int node=0; node<s_numNodes; ++node ) {
+		DebugOutput( "Node %d: %d threads, %lld jobs, %lld us work, %lld us idle\n", node, int(GetNodeStats( node, eNumThreads )), GetNodeStats( node, eNumJobs ),
+			TickToMicroseconds( GetNodeStats( node, eThreadWorkTime )), TickToMicroseconds( GetNodeStats( node, eThreadIdleTime )));
+	}
 }
 
 }
\ No newline at end of file
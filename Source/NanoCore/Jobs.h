@@ -7,10 +7,17 @@
 	Each jobs can depend on 'type' (an integer constant) or be completely independent.
 	The typical use-case is to assign each job to a given type and then chart the dependencies between the types.
 	No individual job to job dependencies are supported for now.
+
+	Clients sharing the workers, e.g. two renderers, each use their own range of types: waiting for, or clearing,
+	the jobs of a range leaves the jobs of the other types running.
+
+	Each job also has a priority lane. Workers always pick a job from the most urgent non-empty lane,
+	so interactive work (e.g. preview tiles) is never queued behind normal or background work.
 */
 
 #include "Common.h"
 
+#define MAX_THREADS 32
 
 
 namespace NanoCore {
@@ -19,7 +26,14 @@ namespace NanoCore {
 
 class IJob {
 public:
-	IJob( int type ) : m_type( type ) {}
+	enum EPriority {
+		ePriorityInteractive,
+		ePriorityNormal,
+		ePriorityBackground,
+		ePriorityCount
+	};
+
+	IJob( int type, EPriority priority = ePriorityNormal ) : m_type( type ), m_priority( priority ) {}
 	virtual ~IJob() {}
 	virtual void Execute() = 0;
 	virtual const wchar_t * GetName() { return L"*IJob*"; }
@@ -27,8 +41,12 @@ public:
 	int GetType() const { return m_type; }
 	void SetType( int type );
 
+	EPriority GetPriority() const { return m_priority; }
+	void SetPriority( EPriority priority );
+
 private:
 	int m_type;
+	EPriority m_priority;
 };
 
 
@@ -39,12 +57,26 @@ struct JobManager {
 		efDisableJobAddition = 2,
 	};
 
-	static void Init( int numThreads, int maxTypes );
+	enum EAffinity {
+		eAffinityNone,      // workers are scheduled freely by the OS
+		eAffinityCore,      // each worker is pinned to its own logical processor
+		eAffinitySMT,       // each worker is pinned to a physical core and may run on any of its SMT siblings
+		eAffinityNumaNode,  // workers are spread round-robin over the NUMA nodes and pinned to the node
+	};
+
+	static void Init( int numThreads, int maxTypes, EAffinity affinity = eAffinityNone );
 	static void Done();
 	static void AddJob( IJob * pJob, int typeToWait = -1 );
 	static void Wait( int flags );
+	static void Wait( int flags, int firstType, int numTypes );  // only the jobs of the types [firstType, firstType+numTypes)
 	static bool IsRunning();
+	static bool IsRunning( int firstType, int numTypes );
 	static int  GetNumThreads();
+	static int  GetNumNodes();
+	static int  GetCurrentThreadNode();  // NUMA node of the calling worker thread, 0 for any other thread
+	static int  GetCurrentThreadIndex(); // [0, GetNumThreads()) for a worker thread, -1 for any other thread
+	static int  GetCurrentJobType();     // type of the job executed by the calling worker thread, -1 outside of a job
+	static EAffinity GetAffinity();
 
 	enum EStats {
 		eNumThreads,
@@ -56,6 +88,7 @@ struct JobManager {
 
 	static void   ResetStats();
 	static uint64 GetStats( EStats stats );
+	static uint64 GetNodeStats( int node, EStats stats );
 
 	static void PrintStats();
 };
@@ -117,6 +117,15 @@ struct float3
 	}
 };
 
+// builds the tangent frame around the unit vector 'n' (Duff et al. 2017)
+inline void orthonormalBasis( float3 n, float3 & t, float3 & b ) {
+	float sign = n.z >= 0.0f ? 1.0f : -1.0f;
+	float a = -1.0f / (sign + n.z);
+	float k = n.x * n.y * a;
+	t = float3( 1.0f + sign * n.x * n.x * a, sign * k, -sign * n.x );
+	b = float3( k, sign + n.y * n.y * a, -n.y );
+}
+
 struct float4 {
 	float x,y,z,w;
 };
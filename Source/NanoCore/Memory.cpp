@@ -0,0 +1,46 @@
+#include "Memory.h"
+
+
+
+namespace NanoCore {
+
+MemoryArena::MemoryArena( size_t blockSize ) : m_BlockSize(blockSize), m_Current(0), m_Offset(0) {
+}
+
+MemoryArena::~MemoryArena() {
+	for( size_t i=0; i<m_Blocks.size(); ++i )
+		delete[] m_Blocks[i].ptr;
+}
+
+void * MemoryArena::Alloc( size_t size, size_t align ) {
+	for( ; m_Current < m_Blocks.size(); ++m_Current, m_Offset = 0 ) {
+		const Block & b = m_Blocks[m_Current];
+		size_t start = (size_t( b.ptr ) + m_Offset + align-1) & ~(align-1);
+		size_t offset = start - size_t( b.ptr );
+		if( offset + size <= b.size ) {
+			m_Offset = offset + size;
+			return b.ptr + offset;
+		}
+	}
+	Block b;
+	b.size = Max( m_BlockSize, size + align );
+	b.ptr = new uint8[b.size];
+	m_Blocks.push_back( b );
+	m_Current = m_Blocks.size()-1;
+	m_Offset = 0;
+	return Alloc( size, align );
+}
+
+void MemoryArena::Reset() {
+	m_Current = 0;
+	m_Offset = 0;
+}
+
+size_t MemoryArena::GetCapacity() const {
+	size_t size = 0;
+	for( size_t i=0; i<m_Blocks.size(); ++i )
+		size += m_Blocks[i].size;
+	return size;
+}
+
+}
@@ -0,0 +1,39 @@
+#ifndef __INC_NANOCORE_MEMORY
+#define __INC_NANOCORE_MEMORY
+
+#include <vector>
+#include "Common.h"
+
+
+
+namespace NanoCore {
+
+// Bump allocator - allocations are never freed individually, Reset() recycles all the memory at once.
+// Blocks are kept between resets, so steady state use does no heap traffic at all.
+class MemoryArena {
+public:
+	MemoryArena( size_t blockSize = 64*1024 );
+	~MemoryArena();
+
+	void * Alloc( size_t size, size_t align = 16 );
+	template< typename T > T * Alloc( size_t count ) {
+		return (T*)Alloc( sizeof(T)*count, __alignof(T) );
+	}
+	void   Reset();
+	size_t GetCapacity() const;
+
+private:
+	MemoryArena( const MemoryArena & );
+	void operator = ( const MemoryArena & );
+
+	struct Block {
+		uint8 * ptr;
+		size_t  size;
+	};
+	std::vector<Block> m_Blocks;
+	size_t m_BlockSize;
+	size_t m_Current, m_Offset;
+};
+
+}
+#endif
@@ -0,0 +1,58 @@
+#include "Random.h"
+
+
+
+namespace NanoCore {
+
+uint32 Hash( uint32 x ) {
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+	return x;
+}
+
+uint32 Hash( uint32 a, uint32 b ) {
+	return Hash( a ^ (Hash( b ) + 0x9e3779b9U + (a << 6) + (a >> 2)) );
+}
+
+static uint32 ReverseBits( uint32 x ) {
+	x = ((x >> 1) & 0x55555555U) | ((x & 0x55555555U) << 1);
+	x = ((x >> 2) & 0x33333333U) | ((x & 0x33333333U) << 2);
+	x = ((x >> 4) & 0x0F0F0F0FU) | ((x & 0x0F0F0F0FU) << 4);
+	x = ((x >> 8) & 0x00FF00FFU) | ((x & 0x00FF00FFU) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+static uint32 LaineKarrasPermutation( uint32 x, uint32 seed ) {
+	x += seed;
+	x ^= x * 0x6c50b47cU;
+	x ^= x * 0xb82f1e52U;
+	x ^= x * 0xc7afe638U;
+	x ^= x * 0x8d22f6e6U;
+	return x;
+}
+
+static uint32 NestedUniformScramble( uint32 x, uint32 seed ) {
+	x = ReverseBits( x );
+	x = LaineKarrasPermutation( x, seed );
+	return ReverseBits( x );
+}
+
+static uint32 Sobol1( uint32 index ) {  // second Sobol dimension, primitive polynomial x + 1
+	uint32 result = 0;
+	for( uint32 v = 1U << 31; index; index >>= 1, v ^= v >> 1 )
+		if( index & 1 )
+			result ^= v;
+	return result;
+}
+
+float2 SobolOwen2D( uint32 index, uint32 seed ) {
+	index = NestedUniformScramble( index, seed );
+	uint32 x = NestedUniformScramble( ReverseBits( index ), Hash( seed, 0 ));
+	uint32 y = NestedUniformScramble( Sobol1( index ), Hash( seed, 1 ));
+	return float2( float( x >> 8 ) * (1.0f / 16777216.0f), float( y >> 8 ) * (1.0f / 16777216.0f) );
+}
+
+}
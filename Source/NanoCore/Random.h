@@ -0,0 +1,53 @@
+#ifndef __INC_NANOCORE_RANDOM
+#define __INC_NANOCORE_RANDOM
+
+#include "Common.h"
+#include "Mathematics.h"
+
+
+
+namespace NanoCore {
+
+// PCG32 (pcg-random.org) - small state, fast, statistically solid, every instance is an independent stream.
+class Random {
+public:
+	Random() { Seed( 0, 1 ); }
+	Random( uint64 seed, uint64 sequence = 1 ) { Seed( seed, sequence ); }
+
+	void Seed( uint64 seed, uint64 sequence = 1 ) {
+		m_state = 0;
+		m_inc = (sequence << 1) | 1;
+		Next();
+		m_state += seed;
+		Next();
+	}
+	uint32 Next() {
+		uint64 old = m_state;
+		m_state = old * 6364136223846793005ULL + m_inc;
+		uint32 xorshifted = uint32( ((old >> 18) ^ old) >> 27 );
+		uint32 rot = uint32( old >> 59 );
+		return (xorshifted >> rot) | (xorshifted << ((0u - rot) & 31));
+	}
+	uint32 Next( uint32 range ) {  // [0, range)
+		return uint32( (uint64(Next()) * range) >> 32 );
+	}
+	float NextFloat() {  // [0, 1)
+		return float( Next() >> 8 ) * (1.0f / 16777216.0f);
+	}
+	float NextFloat( float a, float b ) {
+		return a + NextFloat() * (b - a);
+	}
+
+private:
+	uint64 m_state, m_inc;
+};
+
+uint32 Hash( uint32 x );
+uint32 Hash( uint32 a, uint32 b );
+
+// Owen-scrambled Sobol (0,2)-sequence, Burley 2020 "Practical Hash-based Owen Scrambling".
+// Every 'seed' gives an independent, well stratified 2D point set - any prefix of 2^n points is a (0,n,2)-net.
+float2 SobolOwen2D( uint32 index, uint32 seed );
+
+}
+#endif
@@ -1,5 +1,6 @@
 #include <Windows.h>
 #include <stdarg.h>
+#include <vector>
 #include "Threads.h"
 #include "String.h"
 
@@ -201,11 +202,84 @@ uint32 GetCurrentThreadId() {
 	return ::GetCurrentThreadId();
 }
 
+static void GetCoreMasks( std::vector<uint64> & masks ) {
+	masks.clear();
+	DWORD size = 0;
+	::GetLogicalProcessorInformation( NULL, &size );
+	if( !size )
+		return;
+	std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info( size / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION) );
+	if( !::GetLogicalProcessorInformation( &info[0], &size ))
+		return;
+	for( size_t i=0; i<info.size(); ++i ) {
+		if( info[i].Relationship == RelationProcessorCore )
+			masks.push_back( (uint64)info[i].ProcessorMask );
+	}
+}
+
 void GetSystemInfo( SystemInfo * pInfo ) {
 	if( !pInfo ) return;
 	SYSTEM_INFO si;
 	::GetSystemInfo( &si );
 	pInfo->ProcessorCount = si.dwNumberOfProcessors;
+
+	std::vector<uint64> cores;
+	GetCoreMasks( cores );
+	pInfo->CoreCount = cores.empty() ? pInfo->ProcessorCount : (int)cores.size();
+
+	ULONG highestNode = 0;
+	pInfo->NumaNodeCount = ::GetNumaHighestNodeNumber( &highestNode ) ? int(highestNode) + 1 : 1;
+}
+
+uint64 GetCoreProcessorMask( int core ) {
+	std::vector<uint64> cores;
+	GetCoreMasks( cores );
+	if( core < 0 || core >= (int)cores.size())
+		return 0;
+	return cores[core];
+}
+
+uint64 GetNumaNodeProcessorMask( int node ) {
+	ULONGLONG mask = 0;
+	if( !::GetNumaNodeProcessorMask( (UCHAR)node, &mask ))
+		return 0;
+	return mask;
+}
+
+void SetCurrentThreadAffinity( uint64 mask ) {
+	if( mask )
+		::SetThreadAffinityMask( ::GetCurrentThread(), (DWORD_PTR)mask );
+}
+
+class NumaNodeThread : public Thread {
+public:
+	NumaNodeThread( uint64 mask, void (*pFunc)( void* )) : m_mask(mask), m_pFunc(pFunc), m_bDone(false) {}
+
+	virtual void Run( void * params ) {
+		SetCurrentThreadAffinity( m_mask );
+		m_pFunc( params );
+		m_bDone = true;
+	}
+	bool IsDone() const { return m_bDone; }
+
+private:
+	uint64 m_mask;
+	void (*m_pFunc)( void* );
+	volatile bool m_bDone;
+};
+
+void RunOnNumaNode( int node, void (*pFunc)( void* ), void * param ) {
+	uint64 mask = GetNumaNodeProcessorMask( node );
+	if( !mask ) {
+		pFunc( param );
+		return;
+	}
+	NumaNodeThread thread( mask, pFunc );
+	thread.Start( param );
+	while( !thread.IsDone() )
+		Sleep( 1 );
+	while( thread.IsRunning() )
+		Sleep( 0 );
 }
 
 std::wstring GetCurrentFolder() {
@@ -237,6 +311,10 @@ int32 AtomicDec( volatile int32 * ptr ) {
 	return ::InterlockedDecrement( ptr );
 }
 
+int32 AtomicAdd( volatile int32 * ptr, int32 value ) {
+	return ::InterlockedExchangeAdd( ptr, value );
+}
+
 int32 AtomicCompareAndSwap( volatile int32 * ptr, int32 compare, int32 swap ) {
 	return ::InterlockedCompareExchange( ptr, swap, compare );
 }
@@ -80,6 +80,8 @@ private:
 struct SystemInfo
 {
 	int ProcessorCount;
+	int CoreCount;       // physical cores, each one owns one or more SMT siblings
+	int NumaNodeCount;
 };
 
 void   Sleep( int ms );
@@ -87,12 +89,17 @@ uint64 GetTicks();
 uint64 TickToMicroseconds( uint64 ticks );
 void   DebugOutput( const char * pcFormat, ... );
 void   GetSystemInfo( SystemInfo * pInfo );
+uint64 GetCoreProcessorMask( int core );
+uint64 GetNumaNodeProcessorMask( int node );
+void   SetCurrentThreadAffinity( uint64 mask );
+void   RunOnNumaNode( int node, void (*pFunc)( void* ), void * param );  // blocks until pFunc returns; memory first touched by pFunc is placed on the node
 uint32 GetCurrentThreadId();
 std::wstring GetCurrentFolder();
 std::wstring GetExecutableFolder();
 
 int32 AtomicInc( volatile int32 * ptr );
 int32 AtomicDec( volatile int32 * ptr );
+int32 AtomicAdd( volatile int32 * ptr, int32 value );  // returns the previous value
 int32 AtomicCompareAndSwap( volatile int32 * ptr, int32 compare, int32 swap );
 
 }
@@ -1,6 +1,10 @@
 #include <NanoCore/Threads.h>
 #include <NanoCore/Jobs.h>
 #include <NanoCore/Serialize.h>
+#include <RayTrace/IrradianceCache.h>
+#include <RayTrace/EnvironmentMap.h>
+#include <RayTrace/ShaderPhoto.h>
+#include <RayTrace/Sampler.h>
 #include <vector>
 
 using namespace std;
@@ -74,8 +78,162 @@ struct MainJob : public IJob
 MainJob mjob;
 
 
+// A record gathered next to a wall must be valid over a smaller distance than one gathered in the open: both see
+// the same radiance, only the distances of their hits differ.
+bool TestIrradianceCacheRadius()
+{
+	IrradianceCache cache;
+	cache.Begin( AABB( float3( 0.0f ), float3( 10.0f )), 0, 0.25f, 256 );
+
+	int M, N;
+	IrradianceCache::GetStrata( 256, M, N );
+	float3 n( 0, 1, 0 ), t, b;
+	orthonormalBasis( n, t, b );
+	vector<float3> L( M*N, float3( 1.0f ));
+	vector<float> open( M*N, INFINITE_HITLEN ), wall( M*N );
+	for( int j=0; j<M; ++j )
+		for( int k=0; k<N; ++k ) {
+			float3 dir = IrradianceCache::GetSampleDir( n, t, b, j, k, M, N, float2( 0.5f, 0.5f ));
+			wall[j*N + k] = dir.x < 0.0f ? 0.1f / -dir.x : INFINITE_HITLEN;  // the plane x = 0
+		}
+
+	const float3 pOpen( 5.0f, 0.0f, 2.0f ), pWall( 0.1f, 0.0f, 8.0f ), offset( 0.0f, 0.0f, 0.2f );
+	cache.AddRecord( pOpen, n, &L[0], &open[0], M, N );
+	cache.AddRecord( pWall, n, &L[0], &wall[0], M, N );
+
+	float3 E;
+	bool bOpen = cache.Lookup( pOpen + offset, n, E );
+	bool bWall = cache.Lookup( pWall + offset, n, E );
+	printf( "Irradiance cache radius: %s\n", bOpen && !bWall ? "passed" : "FAILED" );
+	return bOpen && !bWall;
+}
+
+// The density of the sky map samples must integrate to one over the sphere, and the density Sample returns with a
+// direction must be the one Pdf gives it, or the power heuristic weighs the sky and the lobe samples wrongly.
+bool TestEnvironmentMapPdf()
+{
+	const int w = 64, h = 32;
+	vector<float> pixels( w*h*3 );
+	for( int y=0; y<h; ++y )
+		for( int x=0; x<w; ++x ) {
+			float sky = 0.2f + float( x ) / float( w ), sun = (x/2 == 20 && y/2 == 5) ? 500.0f : 0.0f;
+			pixels[(x + y*w)*3 + 0] = sky + sun;
+			pixels[(x + y*w)*3 + 1] = sky * 0.5f + sun;
+			pixels[(x + y*w)*3 + 2] = 0.1f + sun;
+		}
+	EnvironmentMap map;
+	if( !map.Init( &pixels[0], w, h )) {
+		printf( "Environment map pdf: FAILED to init\n" );
+		return false;
+	}
+
+	// 4x4 cells per texel, sin(theta) dtheta dphi each, with the +y up and -z forward of the map
+	const int numTheta = h*4, numPhi = w*4;
+	double integral = 0.0;
+	for( int i=0; i<numTheta; ++i )
+		for( int j=0; j<numPhi; ++j ) {
+			float theta = M_PI * (float( i ) + 0.5f) / float( numTheta ), phi = 2.0f * M_PI * (float( j ) + 0.5f) / float( numPhi );
+			float3 dir( sinf( theta ) * sinf( phi ), cosf( theta ), -sinf( theta ) * cosf( phi ));
+			integral += map.Pdf( dir ) * sinf( theta );
+		}
+	integral *= 2.0 * M_PI * M_PI / double( numTheta * numPhi );
+
+	float maxError = 0.0f;
+	for( int i=0; i<64; ++i )
+		for( int j=0; j<64; ++j ) {
+			float pdf;
+			float3 dir = map.Sample( float2( (float( i ) + 0.5f) / 64.0f, (float( j ) + 0.5f) / 64.0f ), pdf );
+			maxError = Max( maxError, fabsf( map.Pdf( dir ) - pdf ) / pdf );
+		}
+
+	bool bPassed = fabs( integral - 1.0 ) < 0.001 && maxError < 0.001f;
+	printf( "Environment map pdf: integral %.4f, sample pdf error %.5f, %s\n", integral, maxError, bPassed ? "passed" : "FAILED" );
+	return bPassed;
+}
+
+// The sun cone, sky and specular lobe samples of a glossy surface lit by both, combined with the power heuristic,
+// must average to the reflected radiance integrated by brute force: over the sun cone and over the hemisphere.
+bool TestLightSamplingMIS()
+{
+	Material M;
+	NanoCore::Image::Ptr pWhite( new NanoCore::Image( 1, 1, 24 ));
+	int white[3] = { 255, 255, 255 };
+	pWhite->SetPixel( 0, 0, white );
+	M.pDiffuseMap = new Texture();
+	M.pDiffuseMap->Init( pWhite );
+	M.Kd = float3( 0.5f );
+	M.Ns = 200.0f;
+	M.UpdateFeatures();
+
+	Environment env;
+	env.SunSamples = env.GISamples = env.BRDFSamples = 4;
+	env.SunAngle1 = 60.0f;
+	env.SunAngle2 = 20.0f;
+	ShaderPhoto shader;
+	shader.BeginShading( env );
+
+	ShadingPoint sp;
+	sp.Init( M, float2( 0.5f, 0.5f ));
+	const float3 N( 0, 1, 0 ), sun = env.GetSunDir();
+	const float3 V = normalize( N * (2.0f * dot( sun, N )) - sun + float3( 0.05f, 0.0f, 0.0f ));  // next to the mirror direction
+
+	// every pixel is an independent set of samples
+	const int numPixels = 16384, count = shader.GetLightSampleCount( env, M, 0 );
+	double estimate = 0.0;
+	Sampler sampler;
+	for( int i=0; i<numPixels; ++i ) {
+		sampler.Begin( i % 128, i / 128, 0 );
+		for( int k=0; k<count; ++k ) {
+			float3 dir, contrib;
+			float dist;
+			if( shader.SampleLight( sampler, env, sp, float3( 0.0f ), V, N, N, 0, k, dir, dist, contrib ))
+				estimate += contrib.x;
+		}
+	}
+	estimate /= double( numPixels );
+
+	// the sky over the hemisphere in cells of equal solid angle, the sun over its cone
+	double reference = 0.0;
+	const int numZ = 2048, numPhi = 2048;
+	for( int i=0; i<numZ; ++i )
+		for( int j=0; j<numPhi; ++j ) {
+			float z = (float( i ) + 0.5f) / float( numZ ), r = sqrtf( 1.0f - z*z );
+			float phi = 2.0f * M_PI * (float( j ) + 0.5f) / float( numPhi );
+			float3 dir( r * cosf( phi ), z, r * sinf( phi ));
+			reference += sp.BRDF( V, dir, N, env.GetSkyRadiance( dir )).x;
+		}
+	reference *= 2.0 * M_PI / double( numZ * numPhi );
+
+	const float halfAngle = DEG2RAD( env.SunDiskAngle ) * 0.5f, oneMinusCos = 2.0f * sinf( halfAngle * 0.5f ) * sinf( halfAngle * 0.5f );
+	const float3 sunRadiance = env.SunColor * env.SunStrength * (1.0f / (2.0f * M_PI * oneMinusCos));
+	float3 t, b;
+	orthonormalBasis( sun, t, b );
+	double sunPart = 0.0;
+	const int numCone = 256;
+	for( int i=0; i<numCone; ++i )
+		for( int j=0; j<numCone; ++j ) {
+			float x = oneMinusCos * (float( i ) + 0.5f) / float( numCone ), sinT = sqrtf( x * (2.0f - x ));
+			float phi = 2.0f * M_PI * (float( j ) + 0.5f) / float( numCone );
+			float3 dir = normalize( t * (sinT * cosf( phi )) + b * (sinT * sinf( phi )) + sun * (1.0f - x));
+			sunPart += sp.BRDF( V, dir, N, sunRadiance ).x;
+		}
+	reference += sunPart * 2.0 * M_PI * oneMinusCos / double( numCone * numCone );
+
+	const double error = fabs( estimate - reference ) / reference;
+	bool bPassed = error < 0.01;
+	printf( "Light sampling MIS: %.5f against %.5f, %s\n", estimate, reference, bPassed ? "passed" : "FAILED" );
+	return bPassed;
+}
+
 int main()
 {
+	if( !TestIrradianceCacheRadius() )
+		return 1;
+	if( !TestEnvironmentMapPdf() )
+		return 1;
+	if( !TestLightSamplingMIS() )
+		return 1;
+
 	int a,b;
 	int len = sscanf( "138879/83984", "%d/%d", &a, &b );
 
@@ -14,6 +14,15 @@ void Camera::LookAt( float3 lookat_pos, float3 at_vec ) {
 	Orthonormalize();
 }
 
+void Camera::Frame( const float3 & box_min, const float3 & box_max ) {
+	float3 center = (box_min + box_max) * 0.5f;
+	float L = len( box_min - center );
+
+	fovy = 60.0f;
+	world_up = float3(0,1,0);
+	LookAt( center, float3(1,-1,-1)*L );
+}
+
 void Camera::Rotate( float pitch, float yaw ) {
 	matrix m1, m2, m;
 	m1.setRotationAxis( world_up, yaw );
@@ -29,7 +38,7 @@ void Camera::Rotate( float pitch, float yaw ) {
 	up = m * up;
 }
 
-float3 Camera::ConstructRay( int x, int y, int width, int height ) {
+float3 Camera::ConstructRay( int x, int y, int width, int height ) const {
 	float angle = DEG2RAD(fovy) * 0.5f;
 	float tan = ncTan( angle );
 	float kx = (x*2.f/width - 1) * tan * float(width) / height;
@@ -37,6 +46,19 @@ float3 Camera::ConstructRay( int x, int y, int width, int height ) {
 	return normalize( at + right * kx + up * ky );
 }
 
+bool Camera::Project( const float3 & point, int width, int height, float & x, float & y ) const {
+	float3 d = point - pos;
+	float z = dot( d, at );
+	if( z <= 0.0f )
+		return false;
+	float tan = ncTan( DEG2RAD(fovy) * 0.5f );
+	float kx = dot( d, right ) / z;
+	float ky = dot( d, up ) / z;
+	x = (kx * height / (tan * width) + 1) * width * 0.5f;
+	y = (ky / tan + 1) * height * 0.5f;
+	return true;
+}
+
 void Serialize( float3 & f, NanoCore::XmlNode * node ) {
 	node->SerializeAttrib( "x", f.x );
 	node->SerializeAttrib( "y", f.y );
@@ -13,11 +13,13 @@ public:
 	float3 world_up;
 
 	void LookAt( float3 lookat_pos, float3 at_vec );
+	void Frame( const float3 & box_min, const float3 & box_max );  // default view of a box, looking down its diagonal
 	void Orthonormalize();
 	void GetAxes( float3 & _at, float3 & _up, float3 & _right );
 	void Rotate( float pitch, float yaw );
 
-	float3 ConstructRay( int x, int y, int width, int height );
+	float3 ConstructRay( int x, int y, int width, int height ) const;
+	bool   Project( const float3 & point, int width, int height, float & x, float & y ) const;  // inverse of ConstructRay, false behind the camera
 
 	void Serialize( NanoCore::XmlNode * node );
 };
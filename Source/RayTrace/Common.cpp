@@ -1,4 +1,8 @@
+#include <string.h>
+#include <NanoCore/Jobs.h>
+#include <NanoCore/Threads.h>
 #include "Common.h"
+#include "EnvironmentMap.h"
 
 
 
@@ -23,6 +27,47 @@ void IntersectResult::SetTangentSpace( float3 t, float3 b ) {
 
 
 
+__declspec(align(64)) struct ThreadRayStats {
+	RayStats stats;
+};
+
+static ThreadRayStats s_ThreadRayStats[RayStats::MAX_BANKS+1][MAX_THREADS+1];  // the last slot is shared by all non-worker threads
+static int            s_JobTypesPerBank = 1;
+
+void RayStats::SetJobTypesPerBank( int count ) {
+	s_JobTypesPerBank = Max( count, 1 );
+}
+
+RayStats & RayStats::GetThreadStats() {
+	int index = NanoCore::JobManager::GetCurrentThreadIndex();
+	int type = NanoCore::JobManager::GetCurrentJobType();
+	int bank = type >= 0 ? Min( type / s_JobTypesPerBank, int(MAX_BANKS) ) : MAX_BANKS;
+	return s_ThreadRayStats[bank][ (index >= 0 && index < MAX_THREADS) ? index : MAX_THREADS ].stats;
+}
+
+void RayStats::GetTotal( RayStats & total ) {
+	for( int c=0; c<eCount; ++c ) {
+		total.counters[c] = 0;
+		for( int b=0; b<=MAX_BANKS; ++b )
+			for( int i=0; i<=MAX_THREADS; ++i )
+				total.counters[c] += s_ThreadRayStats[b][i].stats.counters[c];
+	}
+}
+
+void RayStats::GetTotal( RayStats & total, int bank ) {
+	for( int c=0; c<eCount; ++c ) {
+		total.counters[c] = 0;
+		for( int i=0; i<=MAX_THREADS; ++i )
+			total.counters[c] += s_ThreadRayStats[bank][i].stats.counters[c];
+	}
+}
+
+void RayStats::Reset() {
+	memset( s_ThreadRayStats, 0, sizeof(s_ThreadRayStats) );
+}
+
+
+
 Texture::Texture() : width(0), height(0) {}
 
 void Texture::Init( NanoCore::Image::Ptr pImage ) {
@@ -37,6 +82,33 @@ void Texture::Init( NanoCore::Image::Ptr pImage ) {
 	}
 }
 
+struct TextureReplicaParams {
+	const std::vector<NanoCore::Image::Ptr> * pSrc;
+	std::vector<NanoCore::Image::Ptr> * pDst;
+};
+
+static void CopyMipsOnNode( void * params ) {
+	TextureReplicaParams * p = (TextureReplicaParams*)params;
+	for( size_t i=0; i<p->pSrc->size(); ++i )
+		p->pDst->push_back( NanoCore::Image::Ptr( new NanoCore::Image( *(*p->pSrc)[i] )));
+}
+
+void Texture::Replicate( int numNodes ) {
+	nodeMips.clear();
+	if( numNodes <= 1 )
+		return;
+	nodeMips.resize( numNodes );
+	for( int node=1; node<numNodes; ++node ) {
+		TextureReplicaParams params = { &mips, &nodeMips[node] };
+		NanoCore::RunOnNumaNode( node, CopyMipsOnNode, &params );
+	}
+}
+
+const std::vector<NanoCore::Image::Ptr> & Texture::GetMips() const {
+	int node = NanoCore::JobManager::GetCurrentThreadNode();
+	return (node > 0 && node < (int)nodeMips.size()) ? nodeMips[node] : mips;
+}
+
 void Texture::GetTexel( float2 uv, float4 & pix ) const {
 	int t[4] = {0};
 	GetTexel( uv, t );
@@ -51,7 +123,7 @@ void Texture::GetTexel( float2 uv, int pix[4] ) const {
 		pix[0] = pix[1] = pix[2] = pix[3] = 0;
 		return;
 	}
-	mips[0]->GetPixel( uv.x, uv.y, pix );
+	GetMips()[0]->GetPixel( uv.x, uv.y, pix );
 }
 
 float3 Texture::GetTexel( float2 uv ) const {
@@ -61,6 +133,7 @@ float3 Texture::GetTexel( float2 uv ) const {
 }
 
 void Texture::GetTexelFiltered( const float2 & uv, float best_resolution, float4 & pix ) const {
+	const std::vector<NanoCore::Image::Ptr> & mips = GetMips();
 	int mip = 0;
 
 	assert( best_resolution >= 1.0f );
@@ -90,7 +163,48 @@ void Texture::GetTexelFiltered( const float2 & uv, float best_resolution, float4
 	pix.w = px[3] * (1.0f/255.0f);
 }
 
-Material::Material() : opacity(1.0f), Ns(0.0f) {
+Material::Material() : opacity(1.0f), Ns(0.0f), features(0) {
 	Kd = float3(1.0f);
 	Ke = float3(0.0f);
-}
\ No newline at end of file
+}
+
+// the "bump" maps of OBJ files are either heights, or tangent space normals that average to a blue close to (0.5,0.5,1)
+static bool IsNormalMap( const Texture & map ) {
+	if( map.IsEmpty() || map.mips[0]->GetBpp() < 24 )
+		return false;
+	const NanoCore::Image & mip = *map.mips.back();
+	float3 avg( 0.0f );
+	for( int y=0; y<mip.GetHeight(); ++y )
+		for( int x=0; x<mip.GetWidth(); ++x ) {
+			int pix[4];
+			mip.GetPixel( x, y, pix );
+			avg += float3( float( pix[0] ), float( pix[1] ), float( pix[2] ));
+		}
+	avg = avg * (1.0f / (255.0f * float( mip.GetWidth() * mip.GetHeight() )));
+	return avg.z > 0.7f && fabsf( avg.x - 0.5f ) < 0.15f && fabsf( avg.y - 0.5f ) < 0.15f;
+}
+
+void Material::UpdateFeatures() {
+	features = 0;
+	if( Ns > 0.0f || pRoughnessMap )
+		features |= eFeatureSpecular;
+	if( (features & eFeatureSpecular) && pSpecularMap )
+		features |= eFeatureSpecularMap;
+	if( pRoughnessMap )
+		features |= eFeatureRoughnessMap;
+	if( pBumpMap )
+		features |= IsNormalMap( *pBumpMap ) ? eFeatureNormalMap : eFeatureBumpMap;
+	if( pAlphaMap )
+		features |= eFeatureAlpha;
+}
+
+float3 Environment::GetSunDir() const {
+	matrix m1, m2;
+	m1.setRotationAxis( float3(1,0,0), DEG2RAD(SunAngle1) );
+	m2.setRotationAxis( float3(0,0,1), DEG2RAD(SunAngle2) );
+	return m2 * m1 * float3(0,0,-1);
+}
+
+float3 Environment::GetSkyRadiance( float3 dir ) const {
+	return (pSkyMap ? pSkyMap->GetRadiance( dir ) : SkyColor) * SkyStrength;
+}
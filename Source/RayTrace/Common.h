@@ -6,19 +6,26 @@
 #include <NanoCore/File.h>
 #include <NanoCore/Image.h>
 
+#include <string>
+
 #define INFINITE_HITLEN 100000.0f
 
+// brightness of a color as the mean of its channels, the weight of the lights, the sky texels and the photons
+inline float Luminance( const float3 & c ) { return (c.x + c.y + c.z) * (1.0f / 3.0f); }
+
 
 
 struct Texture {
 	typedef RefCountPtr<Texture> Ptr;
 
 	std::vector<NanoCore::Image::Ptr> mips;
+	std::vector<std::vector<NanoCore::Image::Ptr>> nodeMips;  // per NUMA node copies of the mips, node 0 uses 'mips'
 	int width, height;
 
 	Texture();
 
 	void Init( NanoCore::Image::Ptr pImage );
+	void Replicate( int numNodes );
 
 	bool   IsEmpty() const { return width == 0; }
 	void   GetTexel( float2 uv, float4 & pix ) const;
@@ -26,15 +33,31 @@ struct Texture {
 	float3 GetTexel( float2 uv ) const;
 
 	void GetTexelFiltered( const float2 & uv, float mipmapcoef, float4 & pix ) const;
+
+private:
+	const std::vector<NanoCore::Image::Ptr> & GetMips() const;
 };
 
 struct Material {
+	// what the material needs from its hits, the shaders pick a kernel specialized for these once per material
+	enum EFeature {
+		eFeatureSpecular     = 1,  // Ns > 0 or a roughness map
+		eFeatureSpecularMap  = 2,  // only with eFeatureSpecular
+		eFeatureRoughnessMap = 4,
+		eFeatureNormalMap    = 8,   // pBumpMap holds tangent space normals
+		eFeatureBumpMap      = 16,  // pBumpMap holds heights
+		eFeatureAlpha        = 32,  // alpha tested by the ray tracing
+		eFeatureShading      = eFeatureSpecular | eFeatureSpecularMap | eFeatureRoughnessMap | eFeatureNormalMap | eFeatureBumpMap,
+	};
+
 	std::string name;
 	Texture::Ptr pAmbientMap, pDiffuseMap, pSpecularMap, pRoughnessMap, pBumpMap, pAlphaMap;
 	float3 Kd, Ks, Ke;
 	float Ns, opacity;
+	int features;  // EFeature flags
 
 	Material();
+	void UpdateFeatures();  // after Ns or the maps change
 };
 
 
@@ -86,11 +109,51 @@ private:
 
 
 struct Ray {
+	enum EType {
+		ePrimary,
+		eShadow,
+		eGI,
+	};
+
 	float3 origin, dir;
 	float hitlen;
+	EType type;
 
 	Ray() {}
-	Ray( float3 origin, float3 dir ) : origin(origin), dir(dir), hitlen(INFINITE_HITLEN) {}
+	Ray( float3 origin, float3 dir, EType type = ePrimary ) : origin(origin), dir(dir), hitlen(INFINITE_HITLEN), type(type) {}
+};
+
+
+
+// Render statistics are counted per thread, each thread owns a cache line, and aggregated only on read.
+// Each Raytracer counts into its own bank, picked by the type of the job the thread executes, so the rays
+// of a preview rendered next to a photo are not counted as the ones of the photo.
+struct RayStats {
+	enum ECounter {
+		ePixels,
+		ePrimaryRays,
+		eShadowRays,
+		eGIRays,
+		eCachedPrimaryHits,  // primary hits taken from the g-buffer instead of being traced
+		eShadedHits,         // hits whose material was evaluated by the photo shader
+		eTextureFetches,     // texel lookups made while evaluating them
+		eNodesVisited,
+		eTrianglesTested,
+		eCount
+	};
+	int64 counters[eCount];
+
+	void  Add( ECounter c, int64 n ) { counters[c] += n; }
+	int64 Get( ECounter c ) const { return counters[c]; }
+	int64 GetRays() const { return counters[ePrimaryRays] + counters[eShadowRays] + counters[eGIRays]; }
+
+	static const int MAX_BANKS = 4;  // the threads outside of a job, or beyond the banks, count into one more
+
+	static void       SetJobTypesPerBank( int count );  // the jobs of the types [bank*count, (bank+1)*count) count into the bank
+	static RayStats & GetThreadStats();  // stats slot of the calling thread
+	static void       GetTotal( RayStats & total );  // of all the banks
+	static void       GetTotal( RayStats & total, int bank );
+	static void       Reset();
 };
 
 
@@ -99,6 +162,7 @@ class IStatusCallback {
 public:
 	virtual ~IStatusCallback() {}
 	virtual void SetStatus( const char * pcFormat, ... ) = 0;
+	virtual bool Confirm( const wchar_t * pwQuestion ) { return false; }  // yes/no question to the user, no one to ask by default
 
 	void ShowLoadingProgress( const char * pcFormat, NanoCore::IFile::Ptr & pFile ) {
 		SetStatus( pcFormat, int(pFile->Tell()*100 / pFile->GetSize()));
@@ -149,14 +213,20 @@ public:
 	virtual void InterpolateTriangleAttributes( IntersectResult & hit, int flags ) const = 0;
 	//virtual float ComputeMipMapCoef( IntersectResult & hit ) const = 0;
 	virtual float ComputeTextureResolution( IntersectResult & hit ) const = 0;
+	virtual void Replicate( int numNodes ) = 0;  // makes NUMA node local copies of the acceleration structure
 };
 
 
 
 
+class EnvironmentMap;
+class LightTree;
+
 struct Environment {
 	int	  GIBounces, GISamples;
 	int   SunSamples;
+	int   BRDFSamples;  // specular lobe samples of the glossy materials, on top of the sun and sky samples
+	int   LightSamples; // samples of the emissive triangles
 	float SunDiskAngle;
 	float SunAngle1, SunAngle2;
 	float SunStrength;
@@ -164,31 +234,41 @@ struct Environment {
 
 	float3 SkyColor;
 	float  SkyStrength;
+	std::string SkyMap;              // equirectangular HDR replacing SkyColor, relative to the model folder
+	const EnvironmentMap * pSkyMap;  // loaded from SkyMap by the Raytracer, NULL for the uniform sky
+	const LightTree * pLights;       // emissive triangles of the scene, set by the Raytracer, NULL without any
 
 	Environment() :
 		GIBounces(0), GISamples(20),
-		SunSamples(10), SunDiskAngle( 0.52f ), SunAngle1(90.0f), SunAngle2(15.0f),
+		SunSamples(10), BRDFSamples(4), LightSamples(4), SunDiskAngle( 0.52f ), SunAngle1(90.0f), SunAngle2(15.0f),
 		SunColor(1,1,1), SunStrength(10),
-		SkyColor(0.75f,0.9f,1), SkyStrength(2)
+		SkyColor(0.75f,0.9f,1), SkyStrength(2), pSkyMap(NULL), pLights(NULL)
 	{}
+
+	float3 GetSunDir() const;  // towards the sun
+	float3 GetSkyRadiance( float3 dir ) const;
 };
 
 class IShader;
+class IrradianceCache;
+class PhotonMap;
+struct ShadingContext;
 
 class IRaytracer {
 public:
 	virtual ~IRaytracer() {}
 	virtual bool   TraceRay( Ray & V, IntersectResult & result ) = 0;
-	virtual float3 RenderRay( Ray & V, IShader * pShader, void * context ) = 0;
+	virtual float3 RenderRay( Ray & V, IShader * pShader, ShadingContext & context ) = 0;
 	virtual const IScene * GetScene() const = 0;
+	virtual IrradianceCache * GetIrradianceCache() = 0;  // NULL when the diffuse indirect light is not cached
+	virtual const PhotonMap * GetPhotonMap() const = 0;  // NULL when the paths are not ended by the photon map
 };
 
 class IShader {
 public:
 	virtual ~IShader() {}
 	virtual void   BeginShading( const Environment & env ) = 0;
-	virtual float3 Shade( Ray & V, IntersectResult & result, const Environment & env, IRaytracer * pRaytracer, void * context ) = 0;
-	virtual void*  CreateContext() = 0;
+	virtual float3 Shade( Ray & V, IntersectResult & result, const Environment & env, IRaytracer * pRaytracer, ShadingContext & context ) = 0;
 };
 
 
@@ -0,0 +1,117 @@
+#include <NanoCore/Image.h>
+#include "EnvironmentMap.h"
+
+#include <algorithm>
+
+
+
+// index of the interval of the normalized CDF holding u, and the position of u inside it
+static int SampleCdf( const float * cdf, int count, float u, float & frac ) {
+	int i = int( std::upper_bound( cdf, cdf + count + 1, u ) - cdf ) - 1;
+	i = Clamp( i, 0, count-1 );
+	float width = cdf[i+1] - cdf[i];
+	frac = width > 0.0f ? Clamp( (u - cdf[i]) / width, 0.0f, 1.0f ) : 0.5f;
+	return i;
+}
+
+
+
+EnvironmentMap::EnvironmentMap() : m_Width(0), m_Height(0), m_PdfScale(0.0f), m_Power(0.0f) {}
+
+void EnvironmentMap::Clear() {
+	m_Width = m_Height = 0;
+	std::vector<float3>().swap( m_Radiance );
+	std::vector<float>().swap( m_Weight );
+	std::vector<float>().swap( m_MarginalCdf );
+	std::vector<float>().swap( m_ConditionalCdf );
+	m_PdfScale = m_Power = 0.0f;
+}
+
+bool EnvironmentMap::Load( const wchar_t * pwFile ) {
+	Clear();
+
+	int w, h;
+	float * pixels = NanoCore::Image::LoadFloat( pwFile, w, h );
+	if( !pixels )
+		return false;
+	bool bLoaded = Init( pixels, w, h );
+	delete[] pixels;
+	return bLoaded;
+}
+
+bool EnvironmentMap::Init( const float * pixels, int w, int h ) {
+	Clear();
+
+	m_Width = w;
+	m_Height = h;
+	m_Radiance.resize( w*h );
+	m_Weight.resize( w*h );
+	m_ConditionalCdf.resize( (w+1)*h );
+	m_MarginalCdf.resize( h+1 );
+
+	double total = 0.0;
+	m_MarginalCdf[0] = 0.0f;
+	for( int y=0; y<h; ++y ) {
+		const float sinT = sinf( M_PI * (float( y ) + 0.5f) / float( h ));
+		float * cdf = &m_ConditionalCdf[y*(w+1)];
+		double row = 0.0;
+		cdf[0] = 0.0f;
+		for( int x=0; x<w; ++x ) {
+			const float * p = pixels + (x + y*w)*3;
+			float3 L( Max( p[0], 0.0f ), Max( p[1], 0.0f ), Max( p[2], 0.0f ));
+			m_Radiance[x + y*w] = L;
+			m_Weight[x + y*w] = Luminance( L ) * sinT;
+			row += m_Weight[x + y*w];
+			cdf[x+1] = float( row );
+		}
+		for( int x=1; x<=w; ++x )
+			cdf[x] = row > 0.0 ? float( cdf[x] / row ) : float( x ) / float( w );
+		total += row;
+		m_MarginalCdf[y+1] = float( total );
+	}
+
+	if( total <= 0.0 ) {
+		Clear();
+		return false;
+	}
+	for( int y=1; y<=h; ++y )
+		m_MarginalCdf[y] = float( m_MarginalCdf[y] / total );
+
+	// a texel covers (2 pi / w) (pi / h) sin(theta) steradians
+	m_PdfScale = float( double( w*h ) / total );
+	m_Power = float( total * 2.0 * M_PI * M_PI / double( w*h ));
+	return true;
+}
+
+int EnvironmentMap::Texel( float3 dir ) const {
+	float u = atan2f( dir.x, -dir.z ) * (0.5f / M_PI);
+	u = u < 0.0f ? u + 1.0f : u;
+	float v = acosf( Clamp( dir.y, -1.0f, 1.0f )) * (1.0f / M_PI);
+	int x = Min( int( u * float( m_Width )), m_Width-1 );
+	int y = Min( int( v * float( m_Height )), m_Height-1 );
+	return x + y*m_Width;
+}
+
+float3 EnvironmentMap::GetRadiance( float3 dir ) const {
+	return m_Radiance[Texel( dir )];
+}
+
+float3 EnvironmentMap::Sample( float2 u, float & pdf ) const {
+	float fy, fx;
+	int y = SampleCdf( &m_MarginalCdf[0], m_Height, u.y, fy );
+	int x = SampleCdf( &m_ConditionalCdf[y*(m_Width+1)], m_Width, u.x, fx );
+
+	float phi = 2.0f * M_PI * (float( x ) + fx) / float( m_Width );
+	float theta = M_PI * (float( y ) + fy) / float( m_Height );
+	float sinT, cosT, sinP, cosP;
+	ncSinCos( theta, sinT, cosT );
+	ncSinCos( phi, sinP, cosP );
+
+	pdf = sinT > 1e-6f ? m_Weight[x + y*m_Width] * m_PdfScale / (2.0f * M_PI * M_PI * sinT) : 0.0f;
+	return float3( sinT * sinP, cosT, -sinT * cosP );
+}
+
+float EnvironmentMap::Pdf( float3 dir ) const {
+	float sinT = ncSqrt( Max( 0.0f, 1.0f - dir.y*dir.y ));
+	return sinT > 1e-6f ? m_Weight[Texel( dir )] * m_PdfScale / (2.0f * M_PI * M_PI * sinT) : 0.0f;
+}
@@ -0,0 +1,41 @@
+#ifndef ___INC_RAYTRACE_ENVIRONMENTMAP
+#define ___INC_RAYTRACE_ENVIRONMENTMAP
+
+#include "Common.h"
+
+#include <vector>
+
+
+
+/*
+	Equirectangular HDR radiance of the sky, +y is up and the center of the image looks down -z. The texels are
+	sampled proportionally to their luminance times the solid angle they cover, through the marginal CDF of the
+	rows and the conditional CDF of the texels of each row, built at load time.
+*/
+class EnvironmentMap {
+public:
+	EnvironmentMap();
+
+	bool Load( const wchar_t * pwFile );
+	bool Init( const float * pixels, int width, int height );  // RGB floats, the top row first
+	void Clear();
+	bool IsLoaded() const { return !m_Radiance.empty(); }
+
+	float3 GetRadiance( float3 dir ) const;
+	float3 Sample( float2 u, float & pdf ) const;  // pdf is per solid angle
+	float  Pdf( float3 dir ) const;                // density of Sample in the direction dir
+	float  GetPower() const { return m_Power; }    // luminance integrated over the sphere
+
+private:
+	int Texel( float3 dir ) const;
+
+	int m_Width, m_Height;
+	std::vector<float3> m_Radiance;
+	std::vector<float>  m_Weight;          // luminance times the sine of the row
+	std::vector<float>  m_MarginalCdf;     // m_Height+1 entries
+	std::vector<float>  m_ConditionalCdf;  // m_Width+1 entries per row
+	float m_PdfScale;                      // texel weight to image space density
+	float m_Power;
+};
+
+#endif
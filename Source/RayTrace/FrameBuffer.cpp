@@ -0,0 +1,120 @@
+#include "FrameBuffer.h"
+
+
+
+FrameBuffer::FrameBuffer() : m_Width(0), m_Height(0) {}
+
+void FrameBuffer::Init( int w, int h ) {
+	m_Width = w;
+	m_Height = h;
+	m_Pixels.resize( w*h );
+	m_Moments.resize( w*h );
+	Clear();
+}
+
+void FrameBuffer::Clear() {
+	float4 zero = { 0.0f, 0.0f, 0.0f, 0.0f };
+	for( size_t i=0; i<m_Pixels.size(); ++i ) {
+		m_Pixels[i] = zero;
+		m_Moments[i] = float2( 0.0f, 0.0f );
+	}
+}
+
+void FrameBuffer::ClearRect( int x0, int y0, int x1, int y1 ) {
+	float4 zero = { 0.0f, 0.0f, 0.0f, 0.0f };
+	for( int y=Max( y0, 0 ); y<Min( y1, m_Height ); ++y )
+		for( int x=Max( x0, 0 ); x<Min( x1, m_Width ); ++x ) {
+			m_Pixels[x + y*m_Width] = zero;
+			m_Moments[x + y*m_Width] = float2( 0.0f, 0.0f );
+		}
+}
+
+void FrameBuffer::AddSample( int x, int y, const float3 & color ) {
+	float4 & p = m_Pixels[x + y*m_Width];
+	p.x += color.x;
+	p.y += color.y;
+	p.z += color.z;
+	p.w += 1.0f;
+
+	float2 & m = m_Moments[x + y*m_Width];
+	float c = MaxChannel( color );
+	m.x += c;
+	m.y += c*c;
+}
+
+float3 FrameBuffer::GetColor( int x, int y ) const {
+	const float4 & p = m_Pixels[x + y*m_Width];
+	if( p.w == 0.0f )
+		return float3( 0.0f );
+	float k = 1.0f / p.w;
+	return float3( p.x*k, p.y*k, p.z*k );
+}
+
+float FrameBuffer::GetError( int x, int y ) const {
+	const float n = m_Pixels[x + y*m_Width].w;
+	if( n < 2.0f )
+		return 1.0f;
+	const float2 & m = m_Moments[x + y*m_Width];
+	float mean = m.x / n;
+	float variance = Max( (m.y - mean*m.x) / (n - 1.0f), 0.0f );
+	float error = ncSqrt( variance / n );
+	float slope = 1.0f / (1.0f + mean);  // derivative of the tonemapping curve x/(1+x)
+	return error * slope * slope;
+}
+
+float FrameBuffer::GetMaxError( int x0, int y0, int x1, int y1 ) const {
+	float error = 0.0f;
+	for( int y=y0; y<y1; ++y )
+		for( int x=x0; x<x1; ++x )
+			error = Max( error, GetError( x, y ));
+	return error;
+}
+
+void FrameBuffer::Tonemap( const float3 & hdrColor, int * ldrColor ) {
+	float lum = Max( hdrColor.x, Max( hdrColor.y, hdrColor.z ));
+	float3 color = hdrColor * ( 1.0f / (1.0f + lum) );
+	ldrColor[0] = int(color.x*255.0f);
+	ldrColor[1] = int(color.y*255.0f);
+	ldrColor[2] = int(color.z*255.0f);
+}
+
+void FrameBuffer::Resolve( NanoCore::Image & image ) const {
+	if( image.GetWidth() != m_Width || image.GetHeight() != m_Height || image.GetBpp() != 24 )
+		return;
+
+	for( int y=0; y<m_Height; ++y ) {
+		uint8 * dst = image.GetImageAt( 0, y );
+		for( int x=0; x<m_Width; ++x, dst += 3 ) {
+			if( !GetSampleCount( x, y ))
+				continue;  // keeps what the image had
+			int rgb[3];
+			Tonemap( GetColor( x, y ), rgb );
+			dst[0] = uint8( rgb[2] );
+			dst[1] = uint8( rgb[1] );
+			dst[2] = uint8( rgb[0] );
+		}
+	}
+}
+
+void FrameBuffer::ResolveSampleDensity( NanoCore::Image & image ) const {
+	if( image.GetWidth() != m_Width || image.GetHeight() != m_Height || image.GetBpp() != 24 )
+		return;
+
+	float minCount = 0.0f, maxCount = 0.0f;
+	for( size_t i=0; i<m_Pixels.size(); ++i ) {
+		float n = m_Pixels[i].w;
+		if( !i || n < minCount ) minCount = n;
+		if( !i || n > maxCount ) maxCount = n;
+	}
+	float k = maxCount > minCount ? 1.0f / (maxCount - minCount) : 0.0f;
+
+	for( int y=0; y<m_Height; ++y ) {
+		uint8 * dst = image.GetImageAt( 0, y );
+		for( int x=0; x<m_Width; ++x, dst += 3 ) {
+			float t = (m_Pixels[x + y*m_Width].w - minCount) * k;
+			dst[0] = uint8( (1.0f - t) * 255.0f );
+			dst[1] = uint8( (t < 0.5f ? t*2.0f : 2.0f - t*2.0f) * 255.0f );
+			dst[2] = uint8( t * 255.0f );
+		}
+	}
+}
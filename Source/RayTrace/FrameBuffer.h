@@ -0,0 +1,43 @@
+#ifndef ___INC_RAYTRACE_FRAMEBUFFER
+#define ___INC_RAYTRACE_FRAMEBUFFER
+
+#include <vector>
+#include <NanoCore/Image.h>
+#include "Common.h"
+
+
+
+// RGBA32F accumulation buffer: rgb keeps the sum of all the samples of a pixel, w keeps their count.
+// The first two moments of the brightest channel of the samples are kept as well, to estimate the error of every pixel.
+class FrameBuffer {
+public:
+	FrameBuffer();
+
+	void Init( int w, int h );
+	void Clear();
+	void ClearRect( int x0, int y0, int x1, int y1 );  // [x0,x1) x [y0,y1)
+
+	void   AddSample( int x, int y, const float3 & color );
+	float3 GetColor( int x, int y ) const;  // average of the samples
+	int    GetSampleCount( int x, int y ) const { return int( m_Pixels[x + y*m_Width].w ); }
+	float  GetError( int x, int y ) const;  // standard error of the pixel mean, measured after tonemapping
+	float  GetMaxError( int x0, int y0, int x1, int y1 ) const;
+
+	int GetWidth() const { return m_Width; }
+	int GetHeight() const { return m_Height; }
+
+	void Resolve( NanoCore::Image & image ) const;  // tonemaps into a 24 bit image, pixels without samples are left untouched
+	void ResolveSampleDensity( NanoCore::Image & image ) const;  // debug view, from blue (fewest samples) to red (most)
+
+	static void Tonemap( const float3 & hdrColor, int * ldrColor );
+
+private:
+	// not Luminance: the noise of a saturated channel shows after tonemapping even when the other channels are dark
+	static float MaxChannel( const float3 & color ) { return Max( color.x, Max( color.y, color.z )); }
+
+	std::vector<float4> m_Pixels;
+	std::vector<float2> m_Moments;  // sum of MaxChannel, sum of MaxChannel squared
+	int m_Width, m_Height;
+};
+
+#endif
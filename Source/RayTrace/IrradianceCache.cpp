@@ -0,0 +1,316 @@
+#include <NanoCore/File.h>
+#include <NanoCore/Random.h>
+#include "IrradianceCache.h"
+#include "LightTree.h"
+
+
+
+static const int    MAX_DEPTH = 24;
+static const uint32 FILE_VERSION = 1;
+
+// accumulates the color 's' times the direction 'dir' into a gradient stored per world axis
+static void AddGradient( float3 * grad, float3 dir, float3 s ) {
+	grad[0] += s * dir.x;
+	grad[1] += s * dir.y;
+	grad[2] += s * dir.z;
+}
+
+static float3 ApplyGradient( const float3 * grad, float3 d ) {
+	return grad[0] * d.x + grad[1] * d.y + grad[2] * d.z;
+}
+
+
+
+IrradianceCache::IrradianceCache() : m_NumRecords(0), m_NumNodes(0), m_Key(0), m_Accuracy(0.0f), m_Samples(0), m_MinR(0.0f), m_MaxR(0.0f), m_bModified(false) {
+	for( int i=0; i<MAX_CHUNKS; ++i ) {
+		m_RecordChunks[i] = NULL;
+		m_NodeChunks[i] = NULL;
+	}
+	m_Box = AABB( float3( 0.0f ), float3( 0.0f ));
+}
+
+IrradianceCache::~IrradianceCache() {
+	for( int i=0; i<MAX_CHUNKS; ++i ) {
+		delete[] m_RecordChunks[i];
+		delete[] m_NodeChunks[i];
+	}
+}
+
+uint32 IrradianceCache::GetLightingKey( const Environment & env, const std::vector<Material> & materials, bool bPhotonMap ) {
+	const float values[] = { float( env.GIBounces ), env.SunDiskAngle, env.SunAngle1, env.SunAngle2, env.SunStrength,
+		env.SunColor.x, env.SunColor.y, env.SunColor.z, env.SkyColor.x, env.SkyColor.y, env.SkyColor.z, env.SkyStrength };
+	uint32 key = 0;
+	for( int i=0; i<int(sizeof(values)/sizeof(values[0])); ++i )
+		key = NanoCore::Hash( key, *(const uint32*)&values[i] );
+	for( size_t i=0; i<env.SkyMap.size(); ++i )
+		key = NanoCore::Hash( key, uint32( uint8( env.SkyMap[i] )));
+	// the emitters come with the scene, their total power catches an edited Ke
+	const float lights = env.pLights ? env.pLights->GetPower() : 0.0f;
+	key = NanoCore::Hash( key, *(const uint32*)&lights );
+	// the light reflected towards the gathered points, and whether their paths end in the photon map
+	for( size_t i=0; i<materials.size(); ++i ) {
+		const float3 & Kd = materials[i].Kd, & Ks = materials[i].Ks;
+		const float reflectance[] = { Kd.x, Kd.y, Kd.z, Ks.x, Ks.y, Ks.z, materials[i].Ns };
+		for( int j=0; j<int(sizeof(reflectance)/sizeof(reflectance[0])); ++j )
+			key = NanoCore::Hash( key, *(const uint32*)&reflectance[j] );
+	}
+	key = NanoCore::Hash( key, bPhotonMap ? 1u : 0u );
+	return key;
+}
+
+void IrradianceCache::Begin( const AABB & box, uint32 key, float accuracy, int samples ) {
+	m_Samples = Max( samples, 1 );
+	bool bSameBox = m_NumNodes && len( box.min - m_Box.min ) + len( box.max - m_Box.max ) <= 1e-4f * len( box.max - box.min );
+	if( bSameBox && key == m_Key && accuracy == m_Accuracy )
+		return;
+	m_Box = box;
+	m_Key = key;
+	m_Accuracy = accuracy;
+	Clear();
+}
+
+void IrradianceCache::Clear() {
+	m_bModified = m_bModified || m_NumRecords > 0;
+	m_NumRecords = 0;
+	m_NumNodes = 0;
+
+	float diag = len( m_Box.max - m_Box.min );
+	m_MinR = diag * 0.001f;
+	m_MaxR = diag * 0.1f;
+
+	float3 size = m_Box.GetSize();
+	NewNode( (m_Box.min + m_Box.max) * 0.5f, Max( size.x, Max( size.y, size.z )) * 0.51f + 1e-4f );
+}
+
+int IrradianceCache::NewNode( float3 center, float half ) {
+	int i = m_NumNodes;
+	if( (i >> CHUNK_SHIFT) >= MAX_CHUNKS )
+		return -1;
+	if( !m_NodeChunks[i >> CHUNK_SHIFT] )
+		m_NodeChunks[i >> CHUNK_SHIFT] = new Node[CHUNK_SIZE];
+	Node & node = GetNode( i );
+	node.center = center;
+	node.half = half;
+	for( int c=0; c<8; ++c )
+		node.child[c] = -1;
+	node.first = -1;
+	m_NumNodes++;
+	return i;
+}
+
+void IrradianceCache::Insert( const Record & r ) {
+	NanoCore::csScope cs( m_csInsert );
+
+	int i = m_NumRecords;
+	if( (i >> CHUNK_SHIFT) >= MAX_CHUNKS )
+		return;  // full, the callers keep using their own gathered values
+	if( !m_RecordChunks[i >> CHUNK_SHIFT] )
+		m_RecordChunks[i >> CHUNK_SHIFT] = new Record[CHUNK_SIZE];
+	Record & record = GetRecord( i );
+	record = r;
+
+	// deepest node still as large as the validity sphere
+	const float radius = m_Accuracy * r.R;
+	int n = 0;
+	for( int depth=0; depth<MAX_DEPTH; ++depth ) {
+		Node & node = GetNode( n );
+		float half = node.half * 0.5f;
+		if( half < radius )
+			break;
+		int c = (r.p.x > node.center.x ? 1 : 0) | (r.p.y > node.center.y ? 2 : 0) | (r.p.z > node.center.z ? 4 : 0);
+		int child = node.child[c];
+		if( child < 0 ) {
+			float3 offset( c & 1 ? half : -half, c & 2 ? half : -half, c & 4 ? half : -half );
+			child = NewNode( node.center + offset, half );
+			if( child < 0 )
+				break;
+			node.child[c] = child;  // published once the node is complete
+		}
+		n = child;
+	}
+
+	// linked after being written, so the concurrent lookups only see complete records
+	Node & node = GetNode( n );
+	record.next = node.first;
+	node.first = i;
+	m_NumRecords = i + 1;
+	m_bModified = true;
+}
+
+bool IrradianceCache::Lookup( float3 p, float3 n, float3 & E ) const {
+	if( !m_NumNodes )
+		return false;
+
+	const float invAccuracy = 1.0f / m_Accuracy;
+	float3 sum( 0.0f );
+	float  weights = 0.0f;
+
+	int stack[MAX_DEPTH * 8];
+	int top = 0;
+	stack[top++] = 0;
+	while( top ) {
+		const Node & node = GetNode( stack[--top] );
+
+		for( int i = node.first; i >= 0; ) {
+			const Record & r = GetRecord( i );
+			i = r.next;
+
+			float3 d = p - r.p;
+			float err = len( d ) / r.R + ncSqrt( Max( 0.0f, 1.0f - dot( n, r.n )));
+			if( err >= m_Accuracy )
+				continue;
+			if( dot( d, (n + r.n) * 0.5f ) < -0.05f * r.R )
+				continue;  // p is in front of the record, its surroundings may be lit differently
+
+			float w = 1.0f / Max( err, 1e-3f ) - invAccuracy;
+			sum += (r.E + ApplyGradient( r.rotGrad, cross( r.n, n )) + ApplyGradient( r.transGrad, d )) * w;
+			weights += w;
+		}
+
+		// records of a node reach at most its half size beyond its bounds
+		for( int c=0; c<8; ++c ) {
+			int child = node.child[c];
+			if( child < 0 )
+				continue;
+			const Node & ch = GetNode( child );
+			float reach = ch.half * 2.0f;
+			if( fabsf( p.x - ch.center.x ) <= reach && fabsf( p.y - ch.center.y ) <= reach && fabsf( p.z - ch.center.z ) <= reach && top < MAX_DEPTH * 8 )
+				stack[top++] = child;
+		}
+	}
+	if( weights <= 0.0f )
+		return false;
+
+	E = sum * (1.0f / weights);
+	E = float3( Max( E.x, 0.0f ), Max( E.y, 0.0f ), Max( E.z, 0.0f ));
+	return true;
+}
+
+void IrradianceCache::GetStrata( int samples, int & M, int & N ) {
+	M = Max( 1, int( ncSqrt( float( samples ) / M_PI ) + 0.5f ));
+	N = Max( 1, samples / M );
+}
+
+float3 IrradianceCache::GetSampleDir( float3 n, float3 t, float3 b, int j, int k, int M, int N, float2 u ) {
+	float sin2 = (float( j ) + u.x) / float( M );
+	float sinT = ncSqrt( sin2 ), cosT = ncSqrt( Max( 0.0f, 1.0f - sin2 ));
+	float s, c;
+	ncSinCos( 2.0f * M_PI * (float( k ) + u.y) / float( N ), s, c );
+	return t * (sinT * c) + b * (sinT * s) + n * cosT;
+}
+
+float3 IrradianceCache::AddRecord( float3 p, float3 n, const float3 * L, const float * dist, int M, int N ) {
+	float3 t, b;
+	orthonormalBasis( n, t, b );
+
+	Record r;
+	r.p = p;
+	r.n = n;
+	r.E = float3( 0.0f );
+	for( int a=0; a<3; ++a ) {
+		r.rotGrad[a] = float3( 0.0f );
+		r.transGrad[a] = float3( 0.0f );
+	}
+
+	float invDist = 0.0f;
+	for( int i=0; i<M*N; ++i ) {
+		r.E += L[i];
+		invDist += 1.0f / Max( dist[i], 1e-6f );
+	}
+	r.E *= M_PI / float( M*N );
+
+	for( int k=0; k<N; ++k ) {
+		const int km = (k + N - 1) % N;
+
+		// rotational gradient, at the center of the strata
+		float s, c;
+		ncSinCos( 2.0f * M_PI * (float( k ) + 0.5f) / float( N ), s, c );
+		float3 rot( 0.0f );
+		for( int j=0; j<M; ++j ) {
+			float sin2 = (float( j ) + 0.5f) / float( M );
+			float tanT = ncSqrt( sin2 / Max( 1.0f - sin2, 1e-6f ));
+			rot += L[j*N + k] * tanT;
+		}
+		AddGradient( r.rotGrad, t * -s + b * c, rot * (M_PI / float( M*N )));
+
+		// translational gradient, across the boundaries of the strata
+		ncSinCos( 2.0f * M_PI * float( k ) / float( N ), s, c );
+		float3 across( 0.0f ), around( 0.0f );
+		for( int j=0; j<M; ++j ) {
+			float sinMinus = ncSqrt( float( j ) / float( M ));
+			float sinPlus = ncSqrt( float( j+1 ) / float( M ));
+			if( j > 0 ) {
+				float cos2 = 1.0f - float( j ) / float( M );
+				across += (L[j*N + k] - L[(j-1)*N + k]) * (sinMinus * cos2 / Min( dist[j*N + k], dist[(j-1)*N + k] ));
+			}
+			around += (L[j*N + k] - L[j*N + km]) * ((sinPlus - sinMinus) / Min( dist[j*N + k], dist[j*N + km] ));
+		}
+		AddGradient( r.transGrad, t * c + b * s, across * (2.0f * M_PI / float( N )));
+		AddGradient( r.transGrad, t * -s + b * c, around );
+	}
+
+	// harmonic mean distance, bounded by the scene size and by the translational gradient
+	r.R = invDist > 0.0f ? float( M*N ) / invDist : m_MaxR;
+	float3 g( Luminance( r.transGrad[0] ), Luminance( r.transGrad[1] ), Luminance( r.transGrad[2] ));
+	if( len( g ) > 0.0f )
+		r.R = Min( r.R, Luminance( r.E ) / len( g ));
+	r.R = Clamp( r.R, m_MinR, m_MaxR );
+	r.next = -1;
+
+	Insert( r );
+	return r.E;
+}
+
+size_t IrradianceCache::GetMemoryUsage() const {
+	size_t size = 0;
+	for( int i=0; i<MAX_CHUNKS; ++i ) {
+		if( m_RecordChunks[i] ) size += sizeof(Record) * CHUNK_SIZE;
+		if( m_NodeChunks[i] ) size += sizeof(Node) * CHUNK_SIZE;
+	}
+	return size;
+}
+
+bool IrradianceCache::Save( const wchar_t * pwFile ) const {
+	NanoCore::IFile::Ptr fp = NanoCore::FS::Open( pwFile, NanoCore::FS::efWriteTrunc );
+	if( !fp )
+		return false;
+
+	uint32 version = FILE_VERSION, key = m_Key;
+	int count = m_NumRecords;
+	float accuracy = m_Accuracy;
+	AABB box = m_Box;
+	fp->Write( &version, sizeof(version) );
+	fp->Write( &key, sizeof(key) );
+	fp->Write( &accuracy, sizeof(accuracy) );
+	fp->Write( &box, sizeof(box) );
+	fp->Write( &count, sizeof(count) );
+	for( int i=0; i<count; ++i )
+		fp->Write( &GetRecord( i ), sizeof(Record) );
+	return true;
+}
+
+bool IrradianceCache::Load( const wchar_t * pwFile ) {
+	NanoCore::IFile::Ptr fp = NanoCore::FS::Open( pwFile, NanoCore::FS::efRead );
+	if( !fp )
+		return false;
+
+	uint32 version = 0;
+	int count = 0;
+	fp->Read( &version, sizeof(version) );
+	if( version != FILE_VERSION )
+		return false;
+	fp->Read( &m_Key, sizeof(m_Key) );
+	fp->Read( &m_Accuracy, sizeof(m_Accuracy) );
+	fp->Read( &m_Box, sizeof(m_Box) );
+	fp->Read( &count, sizeof(count) );
+
+	Clear();
+	Record r;
+	for( int i=0; i<count; ++i ) {
+		if( fp->Read( &r, sizeof(Record) ) != sizeof(Record) )
+			break;
+		Insert( r );
+	}
+	m_bModified = false;
+	return true;
+}
@@ -0,0 +1,87 @@
+#ifndef ___INC_RAYTRACE_IRRADIANCECACHE
+#define ___INC_RAYTRACE_IRRADIANCECACHE
+
+#include <NanoCore/Threads.h>
+#include "Common.h"
+
+#include <vector>
+
+
+
+/*
+	Irradiance cache (Ward 1988) for the diffuse indirect light. Records are gathered lazily where no existing record
+	is valid, each one from a stratified cosine-weighted hemisphere, and are interpolated with their rotational and
+	translational gradients (Ward & Heckbert 1992). Their validity radius follows the harmonic mean distance of the
+	gathered hits, bounded by the scene size and by the translational gradient.
+
+	Records live in an octree over the scene box, each one in the deepest node at least as large as its validity
+	sphere. Lookups never lock: records and nodes are written before being linked, and the storage is made of fixed
+	chunks that never move. Insertions are serialized.
+*/
+class IrradianceCache {
+public:
+	IrradianceCache();
+	~IrradianceCache();
+
+	// keeps the records as long as the scene box, the lighting key and the accuracy do not change
+	void Begin( const AABB & box, uint32 key, float accuracy, int samples );
+	void Clear();
+
+	bool   Lookup( float3 p, float3 n, float3 & E ) const;  // false when no record is valid at p
+	// adds the record gathered over the M x N strata of GetSampleDir, L and dist are indexed j*N + k, returns its irradiance
+	float3 AddRecord( float3 p, float3 n, const float3 * L, const float * dist, int M, int N );
+
+	static void   GetStrata( int samples, int & M, int & N );  // N = pi * M
+	static float3 GetSampleDir( float3 n, float3 t, float3 b, int j, int k, int M, int N, float2 u );
+
+	bool Load( const wchar_t * pwFile );
+	bool Save( const wchar_t * pwFile ) const;
+	bool IsModified() const { return m_bModified; }
+
+	int    GetSampleCount() const { return m_Samples; }  // rays gathered per record
+	int    GetRecordCount() const { return m_NumRecords; }
+	size_t GetMemoryUsage() const;
+
+	// hash of everything the gathered irradiance depends on besides the geometry: lights, sky, materials, photon map
+	static uint32 GetLightingKey( const Environment & env, const std::vector<Material> & materials, bool bPhotonMap );
+
+private:
+	struct Record {
+		float3 p, n, E;
+		float  R;              // harmonic mean distance, clamped
+		float3 rotGrad[3];     // change of E per unit rotation around the x, y and z axes
+		float3 transGrad[3];   // change of E per unit translation along the x, y and z axes
+		volatile int32 next;   // next record of the same node
+	};
+	struct Node {
+		float3 center;
+		float  half;
+		volatile int32 child[8];
+		volatile int32 first;  // first record stored in the node
+	};
+
+	static const int CHUNK_SHIFT = 12;
+	static const int CHUNK_SIZE = 1 << CHUNK_SHIFT;
+	static const int MAX_CHUNKS = 1024;
+
+	Record & GetRecord( int i ) const { return m_RecordChunks[i >> CHUNK_SHIFT][i & (CHUNK_SIZE-1)]; }
+	Node &   GetNode( int i ) const { return m_NodeChunks[i >> CHUNK_SHIFT][i & (CHUNK_SIZE-1)]; }
+	int      NewNode( float3 center, float half );
+	void     Insert( const Record & r );
+
+	Record * m_RecordChunks[MAX_CHUNKS];
+	Node *   m_NodeChunks[MAX_CHUNKS];
+	volatile int32 m_NumRecords;
+	int      m_NumNodes;
+
+	AABB   m_Box;
+	uint32 m_Key;
+	float  m_Accuracy;
+	int    m_Samples;
+	float  m_MinR, m_MaxR;
+	bool   m_bModified;
+
+	NanoCore::CriticalSection m_csInsert;
+};
+
+#endif
@@ -1,6 +1,8 @@
 #include <string>
+#include <algorithm>
 #include <NanoCore/File.h>
-#include <NanoCore/Windows.h>
+#include <NanoCore/Jobs.h>
+#include <NanoCore/Threads.h>
 #include "Camera.h"
 #include "Common.h"
 
@@ -10,6 +12,38 @@ using namespace std;
 //#define BARYCENTRIC_DATA_TRIANGLES
 //#define KEEP_TRIANGLE_ID
 
+// first word of the cached tree, "KD" and the version of the Triangle data, older caches start with their triangle count
+static const int CACHE_VERSION = 0x4b440003;
+
+
+
+// unit tangent in octahedral coordinates, 16 and 15 bits, the top bit is set for a negative bitangent sign
+static uint32 PackTangent( float3 t, float sign ) {
+	float l1 = fabsf( t.x ) + fabsf( t.y ) + fabsf( t.z );
+	float u = t.x / l1, v = t.y / l1;
+	if( t.z < 0.0f ) {
+		float pu = (1.0f - fabsf( v )) * (u < 0.0f ? -1.0f : 1.0f);
+		float pv = (1.0f - fabsf( u )) * (v < 0.0f ? -1.0f : 1.0f);
+		u = pu;
+		v = pv;
+	}
+	uint32 qu = uint32( int( Clamp( u, -1.0f, 1.0f ) * 32767.0f + 32767.5f ));
+	uint32 qv = uint32( int( Clamp( v, -1.0f, 1.0f ) * 16383.0f + 16383.5f ));
+	return qu | (qv << 16) | (sign < 0.0f ? 0x80000000u : 0u);
+}
+
+static float3 UnpackTangent( uint32 packed, float & sign ) {
+	float u = float( int( packed & 0xffff )) * (1.0f / 32767.0f) - 1.0f;
+	float v = float( int( (packed >> 16) & 0x7fff )) * (1.0f / 16383.0f) - 1.0f;
+	sign = (packed & 0x80000000u) ? -1.0f : 1.0f;
+	float3 t( u, v, 1.0f - fabsf( u ) - fabsf( v ));
+	if( t.z < 0.0f ) {
+		t.x = (1.0f - fabsf( v )) * (u < 0.0f ? -1.0f : 1.0f);
+		t.y = (1.0f - fabsf( u )) * (v < 0.0f ? -1.0f : 1.0f);
+	}
+	return normalize( t );
+}
+
 
 
 struct Triangle {
@@ -23,6 +57,7 @@ struct Triangle {
 
 	float2 uv[3];
 	float3 normal[3];
+	uint32 tangent[3];  // per-vertex tangent frames, see PackTangent
 	int    mtl;
 
 #ifdef KEEP_TRIANGLE_ID
@@ -68,14 +103,31 @@ public:
 	//virtual float ComputeMipMapCoef( IntersectResult & hit, int x, int y );
 	//virtual float ComputeMipMapCoef( IntersectResult & hit ) const;
 	virtual float ComputeTextureResolution( IntersectResult & hit ) const;
+	virtual void Replicate( int numNodes );
 
 private:
+	struct Replica {
+		std::vector<Triangle> triangles;
+		std::vector<Node> tree;
+	};
+	struct TraversalStats {
+		int nodes, triangles;
+	};
+	struct ReplicaParams {
+		KDTree * pThis;
+		int node;
+	};
+
 	int  BuildTree( int l, int r );
-	void Intersect_r( int node, Ray & ray, IntersectResult & hit ) const;
+	void BuildTangents( const ISceneLoader * pLoader );
+	void Intersect_r( const Node * pTree, const Triangle * pTriangles, int node, Ray & ray, IntersectResult & hit, TraversalStats & stats ) const;
 	void ComputeBarycentricCoordinates( const float3 & v, const Triangle & tri, float3 & bc ) const;
 
+	static void CopyReplicaOnNode( void * params );
+
 	std::vector<Triangle> m_Triangles;
 	std::vector<Node> m_Tree;
+	std::vector<Replica> m_NodeReplicas;  // per NUMA node copies, node 0 uses m_Triangles/m_Tree
 	int m_maxTrianglesPerNode;
 
 	const Camera * m_pCamera;
@@ -94,6 +146,7 @@ KDTree::~KDTree() {
 }
 void KDTree::Build( const ISceneLoader * pLoader, IStatusCallback * pCallback ) {
 	m_Tree.clear();
+	m_NodeReplicas.clear();
 
 	wstring wFile = pLoader->GetFilename();
 	wFile += L".kdtree";
@@ -102,12 +155,13 @@ void KDTree::Build( const ISceneLoader * pLoader, IStatusCallback * pCallback )
 	if( fp ) {
 		if( pCallback ) pCallback->SetStatus( "Loading cached KD-tree" );
 
-		int numTris, numNodes, mtpn;
+		int version, numTris, numNodes, mtpn;
+		fp->Read( &version, sizeof(version) );
 		fp->Read( &numTris, sizeof(numTris) );
 		fp->Read( &numNodes, sizeof(numNodes) );
 		fp->Read( &mtpn, sizeof(mtpn) );
 
-		if( m_maxTrianglesPerNode == mtpn ) {
+		if( version == CACHE_VERSION && m_maxTrianglesPerNode == mtpn ) {
 			m_Triangles.resize( numTris );
 			m_Tree.resize( numNodes );
 			for( int i=0; i<numTris; ++i )
@@ -162,17 +216,22 @@ void KDTree::Build( const ISceneLoader * pLoader, IStatusCallback * pCallback )
 #endif
 	}
 
+	if( pCallback ) pCallback->SetStatus( "Generating tangent frames" );
+
+	BuildTangents( pLoader );
+
 	if( pCallback ) pCallback->SetStatus( "Building KD-tree" );
 
 	BuildTree( 0, numTris );
 
-	if( NanoCore::WindowMain::MsgBox( L"Warning", L"Should we cache the KD-tree for faster loading?", true )) {
+	if( pCallback && pCallback->Confirm( L"Should we cache the KD-tree for faster loading?" )) {
 		fp = NanoCore::FS::Open( wFile.c_str(), NanoCore::FS::efWriteTrunc );
 		if( fp ) {
 			if( pCallback )
 				pCallback->SetStatus( "Caching KD-tree" );
 			int numTris = (int)m_Triangles.size();
 			int numNodes = (int)m_Tree.size();
+			fp->Write( &CACHE_VERSION, sizeof(CACHE_VERSION) );
 			fp->Write( &numTris, sizeof(numTris) );
 			fp->Write( &numNodes, sizeof(numNodes) );
 			fp->Write( &m_maxTrianglesPerNode, sizeof(m_maxTrianglesPerNode) );
@@ -185,6 +244,83 @@ void KDTree::Build( const ISceneLoader * pLoader, IStatusCallback * pCallback )
 	if( pCallback ) pCallback->SetStatus( NULL );
 }
 
+// Per-vertex tangent frames in the way of MikkTSpace: every corner projects the UV tangent and bitangent of its
+// triangle onto the plane of its vertex normal, takes the sign of dot( cross( normal, tangent ), bitangent ), the corners
+// sharing position, normal, UV and sign add them weighted by their angle, and the bitangent is rebuilt as
+// sign * cross( normal, tangent ) by the shading.
+void KDTree::BuildTangents( const ISceneLoader * pLoader ) {
+	struct Corner {
+		int pos, normal, uv, sign;
+		int index;  // triangle * 3 + vertex
+
+		bool operator < ( const Corner & c ) const {
+			if( pos != c.pos ) return pos < c.pos;
+			if( normal != c.normal ) return normal < c.normal;
+			if( uv != c.uv ) return uv < c.uv;
+			return sign < c.sign;
+		}
+		bool SameVertex( const Corner & c ) const { return pos == c.pos && normal == c.normal && uv == c.uv && sign == c.sign; }
+	};
+
+	const int numTris = (int)m_Triangles.size();
+	std::vector<Corner> corners( numTris * 3 );
+	std::vector<float3> cornerT( numTris * 3 );
+
+	for( int i=0; i<numTris; ++i ) {
+		const Triangle & t = m_Triangles[i];
+		const ISceneLoader::Triangle * p = pLoader->GetTriangle( i );
+
+		float3 e1 = t.pos[1] - t.pos[0], e2 = t.pos[2] - t.pos[0];
+		float2 d1 = t.uv[1] - t.uv[0], d2 = t.uv[2] - t.uv[0];
+		float det = d1.x * d2.y - d2.x * d1.y;
+		float orient = det < 0.0f ? -1.0f : 1.0f;
+		float3 Tuv = (e1 * d2.y - e2 * d1.y) * orient;
+		float3 Buv = (e2 * d1.x - e1 * d2.x) * orient;
+
+		for( int j=0; j<3; ++j ) {
+			Corner & c = corners[i*3 + j];
+			c.pos = p->pos[j];
+			c.normal = p->normal[j] >= 0 ? p->normal[j] : -1 - i;  // face normals are not shared
+			c.uv = p->uv[j];
+			c.index = i*3 + j;
+
+			// the handedness of the UV frame against the vertex normal, not the triangle winding
+			const float3 & n = t.normal[j];
+			c.sign = dot( cross( n, Tuv ), Buv ) < 0.0f ? -1 : 1;
+			float3 T = Tuv - n * dot( n, Tuv );
+			float l = len( T );
+			float3 a = t.pos[(j+1)%3] - t.pos[j], b = t.pos[(j+2)%3] - t.pos[j];
+			float la = len( a ), lb = len( b );
+			float angle = (la > 0.0f && lb > 0.0f) ? acosf( Clamp( dot( a, b ) / (la * lb), -1.0f, 1.0f )) : 0.0f;
+			cornerT[i*3 + j] = (l > 0.0f && fabsf( det ) > 1e-12f) ? T * (angle / l) : float3( 0.0f );
+		}
+	}
+
+	std::sort( corners.begin(), corners.end() );
+	for( size_t first=0; first<corners.size(); ) {
+		size_t last = first + 1;
+		float3 sum = cornerT[corners[first].index];
+		while( last < corners.size() && corners[last].SameVertex( corners[first] ))
+			sum += cornerT[corners[last++].index];
+
+		for( size_t k=first; k<last; ++k ) {
+			const int index = corners[k].index;
+			Triangle & t = m_Triangles[index / 3];
+			const float3 & n = t.normal[index % 3];
+			float3 T = sum - n * dot( n, sum );
+			float l = len( T );
+			if( l > 1e-12f ) {
+				T = T * (1.0f / l);
+			} else {
+				float3 B;
+				orthonormalBasis( n, T, B );
+			}
+			t.tangent[index % 3] = PackTangent( T, float( corners[k].sign ));
+		}
+		first = last;
+	}
+}
+
 int KDTree::BuildTree( int l, int r ) {
 	if( l >= r )
 		return 0;
@@ -260,10 +396,9 @@ int KDTree::BuildTree( int l, int r ) {
 	return node;
 }
 
-int64 rays_traced = 0;
-
-void KDTree::Intersect_r( int node_index, Ray & ray, IntersectResult & result ) const {
-	const Node & node = m_Tree[node_index];
+void KDTree::Intersect_r( const Node * pTree, const Triangle * pTriangles, int node_index, Ray & ray, IntersectResult & result, TraversalStats & stats ) const {
+	const Node & node = pTree[node_index];
+	stats.nodes++;
 
 	float3 origin = ray.origin;
 	float3 dir = ray.dir;
@@ -303,11 +438,12 @@ void KDTree::Intersect_r( int node_index, Ray & ray, IntersectResult & result )
 
 	const int count = node.numTriangles;
 	if( count ) {
+		stats.triangles += count;
 
 		const Triangle * best_triangle = NULL;
 		float3 best_bary, best_hit;
 
-		const Triangle * ptr = &m_Triangles[0] + node.startTriangle;
+		const Triangle * ptr = pTriangles + node.startTriangle;
 		for( int i=0; i<count; ++i ) {
 			const Triangle & t = ptr[i];
 			//(px + t.vx)*A + (py + t.vy)*B + (pz + t.vz)*C = -D
@@ -357,14 +493,14 @@ void KDTree::Intersect_r( int node_index, Ray & ray, IntersectResult & result )
 	else
 		a = node.right, b = node.left;
 
-	if( a ) Intersect_r( a, ray, result );
-	if( b ) Intersect_r( b, ray, result );
+	if( a ) Intersect_r( pTree, pTriangles, a, ray, result, stats );
+	if( b ) Intersect_r( pTree, pTriangles, b, ray, result, stats );
 
 #else
 	if( node.left )
-		Intersect_r( node.left, ray, result );
+		Intersect_r( pTree, pTriangles, node.left, ray, result, stats );
 	if( node.right )
-		Intersect_r( node.right, ray, result );
+		Intersect_r( pTree, pTriangles, node.right, ray, result, stats );
 #endif
 
 }
@@ -373,10 +509,38 @@ bool KDTree::IntersectRay( const Ray & ray, IntersectResult & result ) const {
 	if( m_Tree.empty()) return false;
 
 	Ray r(ray);
-	Intersect_r( 0, r, result );
+	TraversalStats stats = { 0, 0 };
+	int node = NanoCore::JobManager::GetCurrentThreadNode();
+	if( node > 0 && node < (int)m_NodeReplicas.size() ) {
+		const Replica & replica = m_NodeReplicas[node];
+		Intersect_r( &replica.tree[0], &replica.triangles[0], 0, r, result, stats );
+	} else {
+		Intersect_r( &m_Tree[0], &m_Triangles[0], 0, r, result, stats );
+	}
+	RayStats & rs = RayStats::GetThreadStats();
+	rs.Add( RayStats::eNodesVisited, stats.nodes );
+	rs.Add( RayStats::eTrianglesTested, stats.triangles );
 	return result.triangle != NULL;
 }
 
+void KDTree::CopyReplicaOnNode( void * params ) {
+	ReplicaParams * p = (ReplicaParams*)params;
+	Replica & replica = p->pThis->m_NodeReplicas[p->node];
+	replica.triangles = p->pThis->m_Triangles;
+	replica.tree = p->pThis->m_Tree;
+}
+
+void KDTree::Replicate( int numNodes ) {
+	m_NodeReplicas.clear();
+	if( numNodes <= 1 || IsEmpty() )
+		return;
+	m_NodeReplicas.resize( numNodes );
+	for( int node=1; node<numNodes; ++node ) {
+		ReplicaParams params = { this, node };
+		NanoCore::RunOnNumaNode( node, CopyReplicaOnNode, &params );
+	}
+}
+
 bool KDTree::IsEmpty() const {
 	return m_Tree.empty();
 }
@@ -387,37 +551,6 @@ AABB KDTree::GetAABB() const {
 	return AABB( m_Tree[0].min, m_Tree[0].max );
 }
 
-static void ComputeTangentBasis( const Triangle & tri, float3 & tangent, float3 & bitangent ) {
-
-	const float3 * pos = tri.pos;
-	const float2 * uv = tri.uv;
-
-//  pure geometric method - find a point with the same U-coordinate on the edge21 as the U0, this is tangent
-
-	float2 duv21 = uv[2] - uv[1];
-	float2 duv20 = uv[2] - uv[0];
-	float2 duv10 = uv[1] - uv[0];
-
-	float3 edge20 = pos[2] - pos[0];
-	float3 edge21 = pos[2] - pos[1];
-
-	float3 t,b;
-
-	if( duv21.x > -0.001f && duv21.x < 0.001f ) {
-		t = pos[0] + edge20 * duv10.x / duv20.x - pos[1];
-		if( duv10.y > 0 ) t = -t;
-		b = pos[1] + edge21 * -duv10.y / duv21.y - pos[0];
-		if( duv10.x > 0 ) b = -b;
-	} else {
-		t = pos[1] + edge21 * -duv10.x / duv21.x - pos[0];
-		if( duv10.y < 0 ) t = -t;
-		b = pos[0] + edge20 * duv10.y / duv20.y - pos[1];
-		if( duv10.x < 0 ) b = -b;
-	}
-	tangent = normalize( t );
-	bitangent = normalize( b );
-}
-
 void KDTree::InterpolateTriangleAttributes( IntersectResult & result, int flags ) const {
 	if( !result.triangle )
 		return;
@@ -432,18 +565,21 @@ void KDTree::InterpolateTriangleAttributes( IntersectResult & result, int flags
 		result.SetInterpolatedNormal( normalize( t->normal[0]*result.barycentric.x + t->normal[1]*result.barycentric.y + t->normal[2]*result.barycentric.z ));
 	}
 	if( flags & IntersectResult::eTangentSpace ) {
-		float3 T, B;
-		ComputeTangentBasis( *t, T, B );
+		const float3 & bc = result.barycentric;
+		float s0, s1, s2;
+		float3 T = UnpackTangent( t->tangent[0], s0 ) * bc.x + UnpackTangent( t->tangent[1], s1 ) * bc.y + UnpackTangent( t->tangent[2], s2 ) * bc.z;
+		float sign = (s0*bc.x + s1*bc.y + s2*bc.z) < 0.0f ? -1.0f : 1.0f;
 
 		float3 n = result.GetInterpolatedNormal();
-
-		float3 b = normalize( cross( n, T ));
-		if( dot( B, b ) < 0.0f ) b = -b;
-
-		float3 t = normalize( cross( b, n ));
-		if( dot( T, t ) < 0.0f ) t = -t;
-
-		result.SetTangentSpace( t, b );
+		T = T - n * dot( n, T );
+		float l = len( T );
+		if( l > 1e-6f ) {
+			T = T * (1.0f / l);
+		} else {
+			float3 B;
+			orthonormalBasis( n, T, B );
+		}
+		result.SetTangentSpace( T, cross( n, T ) * sign );
 	}
 }
 
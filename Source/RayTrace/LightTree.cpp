@@ -0,0 +1,198 @@
+#include <NanoCore/Threads.h>
+#include "LightTree.h"
+
+#include <algorithm>
+
+
+
+static float SafeAcos( float x ) { return acosf( Clamp( x, -1.0f, 1.0f )); }
+
+static float3 Centroid( const LightTree::Emitter & e ) {
+	return e.p0 + (e.e1 + e.e2) * (1.0f / 3.0f);
+}
+
+// smallest cone holding the cones (a, ta) and (b, tb), half angles in radians
+static void UnionCone( float3 & a, float & ta, float3 b, float tb ) {
+	if( ta < tb ) {
+		float3 t = a; a = b; b = t;
+		float f = ta; ta = tb; tb = f;
+	}
+	float td = SafeAcos( dot( a, b ));
+	if( Min( td + tb, M_PI ) <= ta )
+		return;
+	float to = (ta + td + tb) * 0.5f;
+	float3 ortho = b - a * dot( a, b );
+	if( to >= M_PI || dot( ortho, ortho ) < 1e-12f ) {
+		ta = M_PI;
+		return;
+	}
+	float tr = to - ta;
+	a = normalize( a * cosf( tr ) + normalize( ortho ) * sinf( tr ));
+	ta = to;
+}
+
+
+
+LightTree::LightTree() : m_Power(0.0f), m_bUseTree(true) {}
+
+void LightTree::Clear() {
+	std::vector<Emitter>().swap( m_Emitters );
+	std::vector<float>().swap( m_PowerCdf );
+	std::vector<Node>().swap( m_Nodes );
+	m_Power = 0.0f;
+}
+
+void LightTree::Build( const ISceneLoader * pLoader, const std::vector<Material> & materials ) {
+	Clear();
+
+	for( int i=0, n=pLoader->GetNumTriangles(); i<n; ++i ) {
+		const ISceneLoader::Triangle * tri = pLoader->GetTriangle( i );
+		if( tri->material < 0 || tri->material >= int( materials.size() ))
+			continue;
+		const float3 & Le = materials[tri->material].Ke;
+		if( Luminance( Le ) <= 0.0f )
+			continue;
+
+		Emitter e;
+		e.p0 = *pLoader->GetVertexPos( tri->pos[0] );
+		e.e1 = *pLoader->GetVertexPos( tri->pos[1] ) - e.p0;
+		e.e2 = *pLoader->GetVertexPos( tri->pos[2] ) - e.p0;
+		float3 c = cross( e.e1, e.e2 );
+		float l = len( c );
+		if( l <= 0.0f )
+			continue;
+		e.n = c * (1.0f / l);
+		e.area = l * 0.5f;
+		e.Le = Le;
+		e.power = Luminance( Le ) * e.area * M_PI;
+		m_Emitters.push_back( e );
+	}
+	if( m_Emitters.empty() )
+		return;
+
+	m_PowerCdf.resize( m_Emitters.size() + 1 );
+	m_PowerCdf[0] = 0.0f;
+	double sum = 0.0;
+	for( size_t i=0; i<m_Emitters.size(); ++i ) {
+		sum += m_Emitters[i].power;
+		m_PowerCdf[i+1] = float( sum );
+	}
+	m_Power = float( sum );
+	for( size_t i=1; i<m_PowerCdf.size(); ++i )
+		m_PowerCdf[i] = float( m_PowerCdf[i] / sum );
+
+	std::vector<int> emitters( m_Emitters.size() );
+	for( size_t i=0; i<emitters.size(); ++i )
+		emitters[i] = int( i );
+	m_Nodes.reserve( emitters.size() * 2 );
+	BuildNode( &emitters[0], int( emitters.size() ));
+
+	NanoCore::DebugOutput( "%d emissive triangles, light tree of %d nodes\n", GetCount(), int( m_Nodes.size() ));
+}
+
+int LightTree::BuildNode( int * emitters, int count ) {
+	const int index = int( m_Nodes.size() );
+	m_Nodes.push_back( Node() );
+
+	Node node;
+	const Emitter & first = m_Emitters[emitters[0]];
+	node.box = AABB( first.p0, first.p0 );
+	node.axis = first.n;
+	node.theta = 0.0f;
+	node.power = 0.0f;
+	node.right = -1;
+	node.emitter = emitters[0];
+	AABB centroids( Centroid( first ), Centroid( first ));
+	for( int i=0; i<count; ++i ) {
+		const Emitter & e = m_Emitters[emitters[i]];
+		node.box += e.p0;
+		node.box += e.p0 + e.e1;
+		node.box += e.p0 + e.e2;
+		centroids += Centroid( e );
+		UnionCone( node.axis, node.theta, e.n, 0.0f );
+		node.power += e.power;
+	}
+
+	if( count > 1 ) {
+		// median split of the centroids along the widest axis
+		float3 size = centroids.GetSize();
+		int axis = (size.x >= size.y && size.x >= size.z) ? 0 : (size.y >= size.z ? 1 : 2);
+		const int half = count / 2;
+		const std::vector<Emitter> & all = m_Emitters;
+		std::nth_element( emitters, emitters + half, emitters + count, [&all, axis]( int a, int b ) {
+			float3 ca = Centroid( all[a] ), cb = Centroid( all[b] );
+			return axis == 0 ? ca.x < cb.x : (axis == 1 ? ca.y < cb.y : ca.z < cb.z);
+		});
+		BuildNode( emitters, half );
+		node.right = BuildNode( emitters + half, count - half );
+		node.emitter = -1;
+	}
+	m_Nodes[index] = node;
+	return index;
+}
+
+float LightTree::Importance( const Node & node, float3 p, float3 N ) const {
+	const float3 c = (node.box.min + node.box.max) * 0.5f;
+	const float r = len( node.box.max - node.box.min ) * 0.5f;
+	float3 d = p - c;
+	float dist2 = dot( d, d );
+	float dist = ncSqrt( dist2 );
+	float3 w = dist > 0.0f ? d * (1.0f / dist) : N;
+	dist2 = Max( dist2, r*r * 0.25f );
+
+	// angle subtended by the bounding sphere, nothing can be excluded from inside of it
+	float thetaU = dist > r ? asinf( r / dist ) : M_PI;
+
+	// emitters facing away from p, beyond the cone, and p facing away from all of them
+	float theta = Max( 0.0f, SafeAcos( dot( node.axis, w )) - node.theta - thetaU );
+	if( theta >= M_PI * 0.5f )
+		return 0.0f;
+	float thetaI = Max( 0.0f, SafeAcos( dot( N, -w )) - thetaU );
+	if( thetaI >= M_PI * 0.5f )
+		return 0.0f;
+	return node.power * cosf( theta ) * cosf( thetaI ) / dist2;
+}
+
+int LightTree::Pick( float u, float3 p, float3 N, float & pmf ) const {
+	if( !m_bUseTree )
+		return PickByPower( u, pmf );
+	if( m_Nodes.empty() )
+		return -1;
+
+	// u is rescaled at each level, so one number drives the whole walk
+	pmf = 1.0f;
+	int n = 0;
+	while( m_Nodes[n].right >= 0 ) {
+		float wl = Importance( m_Nodes[n+1], p, N );
+		float wr = Importance( m_Nodes[m_Nodes[n].right], p, N );
+		if( wl + wr <= 0.0f )
+			return -1;
+		float pl = wl / (wl + wr);
+		if( u < pl ) {
+			u = Min( u / pl, 0.99999994f );
+			pmf *= pl;
+			n = n+1;
+		} else {
+			u = Min( (u - pl) / (1.0f - pl), 0.99999994f );
+			pmf *= 1.0f - pl;
+			n = m_Nodes[n].right;
+		}
+	}
+	return m_Nodes[n].emitter;
+}
+
+int LightTree::PickByPower( float u, float & pmf ) const {
+	if( m_Emitters.empty() )
+		return -1;
+	int count = int( m_Emitters.size() );
+	int i = int( std::upper_bound( m_PowerCdf.begin(), m_PowerCdf.end(), u ) - m_PowerCdf.begin() ) - 1;
+	i = Clamp( i, 0, count-1 );
+	pmf = m_PowerCdf[i+1] - m_PowerCdf[i];
+	return pmf > 0.0f ? i : -1;
+}
+
+float3 LightTree::SamplePoint( int i, float2 u ) const {
+	const Emitter & e = m_Emitters[i];
+	float s = ncSqrt( u.x );
+	return e.p0 + e.e1 * (s * (1.0f - u.y)) + e.e2 * (s * u.y);
+}
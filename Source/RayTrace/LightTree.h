@@ -0,0 +1,63 @@
+#ifndef ___INC_RAYTRACE_LIGHTTREE
+#define ___INC_RAYTRACE_LIGHTTREE
+
+#include "Common.h"
+
+#include <vector>
+
+
+
+/*
+	Emissive triangles of the scene (Material::Ke), one-sided diffuse emitters. An emitter is picked either
+	proportionally to its power, or by walking a light BVH (Conty Estevez & Kulla 2018): every node bounds its
+	emitters with a box, a cone of their normals and their total power, and a walk picks the child whose bounds
+	promise the larger contribution at the shading point. The cost of a pick is the depth of the tree, so it does
+	not grow with the number of emitters.
+*/
+class LightTree {
+public:
+	struct Emitter {
+		float3 p0, e1, e2;  // first vertex and the two edges from it
+		float3 n;           // emitting side
+		float  area;
+		float3 Le;          // emitted radiance
+		float  power;       // luminance of the emitted flux
+	};
+
+	LightTree();
+
+	void Build( const ISceneLoader * pLoader, const std::vector<Material> & materials );
+	void Clear();
+	void SetUseTree( bool bUseTree ) { m_bUseTree = bUseTree; }
+
+	bool  IsEmpty() const { return m_Emitters.empty(); }
+	int   GetCount() const { return int( m_Emitters.size() ); }
+	float GetPower() const { return m_Power; }
+	const Emitter & GetEmitter( int i ) const { return m_Emitters[i]; }
+
+	// emitter for the shading point at p with the normal N, -1 when none can light it, pmf is its probability
+	int    Pick( float u, float3 p, float3 N, float & pmf ) const;
+	int    PickByPower( float u, float & pmf ) const;
+	float3 SamplePoint( int i, float2 u ) const;  // uniform over the area of the emitter
+
+private:
+	struct Node {
+		AABB   box;
+		float3 axis;   // of the cone of the emitter normals
+		float  theta;  // half angle of the cone
+		float  power;
+		int    right;  // the left child follows its parent, -1 for a leaf
+		int    emitter;
+	};
+
+	int   BuildNode( int * emitters, int count );
+	float Importance( const Node & node, float3 p, float3 N ) const;
+
+	std::vector<Emitter> m_Emitters;
+	std::vector<float>   m_PowerCdf;  // m_Emitters.size()+1 entries
+	std::vector<Node>    m_Nodes;
+	float m_Power;
+	bool  m_bUseTree;
+};
+
+#endif
@@ -3,7 +3,6 @@
 #include <string>
 #include <NanoCore/File.h>
 #include <NanoCore/Threads.h>
-#include <NanoCore/Windows.h>
 #include "Common.h"
 
 
@@ -322,7 +321,7 @@ bool ObjectFileLoader::Load( const wchar_t * pwFilename, IStatusCallback * pCall
 	if( pCallback ) pCallback->SetStatus( NULL );
 	ShowStats( pwFilename );
 	NanoCore::DebugOutput( "\tbox min: %0.3f, %0.3f, %0.3f\n\tbox max: %0.3f, %0.3f, %0.3f\n", box.min.x, box.min.y, box.min.z, box.max.x, box.max.y, box.max.z );
-	if( NanoCore::WindowMain::MsgBox( L"Warning", L"Should we cache the OBJ file into binary for faster loading?", true ))
+	if( pCallback && pCallback->Confirm( L"Should we cache the OBJ file into binary for faster loading?" ))
 		Save( wFilenameCached.c_str(), pCallback );
 	return true;
 }
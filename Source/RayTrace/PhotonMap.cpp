@@ -0,0 +1,267 @@
+#include <NanoCore/Jobs.h>
+#include <NanoCore/Threads.h>
+#include <NanoCore/Random.h>
+#include "PhotonMap.h"
+#include "Sampler.h"
+#include "ShaderPhoto.h"
+#include "EnvironmentMap.h"
+#include "LightTree.h"
+
+
+
+static void Quantize( float3 v, int8 * q ) {
+	q[0] = int8( Clamp( v.x, -1.0f, 1.0f ) * 127.0f );
+	q[1] = int8( Clamp( v.y, -1.0f, 1.0f ) * 127.0f );
+	q[2] = int8( Clamp( v.z, -1.0f, 1.0f ) * 127.0f );
+}
+
+static float3 Dequantize( const int8 * q ) {
+	return float3( float( q[0] ), float( q[1] ), float( q[2] )) * (1.0f / 127.0f);
+}
+
+
+
+class PhotonMap::TraceJob : public NanoCore::IJob {
+public:
+	TraceJob( PhotonMap * pMap, int chunk, int type ) : IJob( type ), pMap(pMap), chunk(chunk) {}
+
+	virtual void Execute() { pMap->TraceChunk( chunk ); }
+	virtual const wchar_t * GetName() { return L"PhotonTrace"; }
+
+	PhotonMap * pMap;
+	int chunk;
+};
+
+
+
+PhotonMap::PhotonMap() : m_CellMask(0), m_Radius(0.0f), m_InvCellSize(0.0f), m_pRaytracer(NULL), m_pScene(NULL), m_pEnv(NULL), m_SceneRadius(0.0f), m_SkyScale(0.0f),
+	m_NumPhotons(0), m_NumSunPhotons(0), m_NumLightPhotons(0), m_MaxDepth(0), m_Key(0), m_bBuilt(false), m_BuildSeconds(0.0f) {}
+
+PhotonMap::~PhotonMap() {}
+
+void PhotonMap::Clear() {
+	std::vector<Photon>().swap( m_Photons );
+	std::vector<int>().swap( m_CellStart );
+	m_CellMask = 0;
+	m_bBuilt = false;
+}
+
+void PhotonMap::Build( IRaytracer * pRaytracer, const IScene * pScene, const Environment & env, int numPhotons, float radius, uint32 key, int jobType ) {
+	const uint64 t0 = NanoCore::GetTicks();
+	Clear();
+
+	m_pRaytracer = pRaytracer;
+	m_pScene = pScene;
+	AABB box = pScene->GetAABB();
+	m_Center = (box.min + box.max) * 0.5f;
+	m_SceneRadius = len( box.max - box.min ) * 0.505f + 1e-4f;
+	m_SunDir = env.GetSunDir();
+	m_MaxDepth = env.GIBounces;
+	m_NumPhotons = Max( numPhotons, 0 );
+
+	// the flux through the emission disk and the flux of the emitters, the photons are split by their share of it
+	const float diskArea = M_PI * m_SceneRadius * m_SceneRadius;
+	const float3 sunFlux = env.SunColor * (env.SunStrength * diskArea);
+	const float skyFlux = env.SkyStrength * diskArea * (env.pSkyMap ? env.pSkyMap->GetPower() : 4.0f * M_PI * Luminance( env.SkyColor ));
+	const float lightFlux = env.pLights ? env.pLights->GetPower() : 0.0f;
+	const float total = Luminance( sunFlux ) + skyFlux + lightFlux;
+	m_NumSunPhotons = total > 0.0f ? int( float( m_NumPhotons ) * Luminance( sunFlux ) / total + 0.5f ) : 0;
+	m_NumLightPhotons = total > 0.0f ? Min( int( float( m_NumPhotons ) * lightFlux / total + 0.5f ), m_NumPhotons - m_NumSunPhotons ) : 0;
+	const int numSkyPhotons = total > 0.0f && skyFlux > 0.0f ? m_NumPhotons - m_NumSunPhotons - m_NumLightPhotons : 0;
+	m_SunPower = m_NumSunPhotons ? sunFlux * (1.0f / float( m_NumSunPhotons )) : float3( 0.0f );
+	m_SkyScale = numSkyPhotons ? diskArea / float( numSkyPhotons ) : 0.0f;
+	m_pEnv = &env;
+	m_NumPhotons = m_NumSunPhotons + m_NumLightPhotons + numSkyPhotons;
+
+	if( NanoCore::JobManager::GetNumThreads() > 0 ) {
+		std::vector<TraceJob> jobs;
+		jobs.reserve( NUM_CHUNKS );
+		for( int i=0; i<NUM_CHUNKS; ++i )
+			jobs.push_back( TraceJob( this, i, jobType ));
+		for( int i=0; i<NUM_CHUNKS; ++i )
+			NanoCore::JobManager::AddJob( &jobs[i] );
+		NanoCore::JobManager::Wait( 0, jobType, 1 );
+	} else {
+		for( int i=0; i<NUM_CHUNKS; ++i )
+			TraceChunk( i );
+	}
+
+	// hashed grid, cells are twice the radius wide and sorted by a counting sort
+	size_t count = 0;
+	for( int i=0; i<NUM_CHUNKS; ++i )
+		count += m_ChunkPhotons[i].size();
+	uint32 cells = 1024;
+	while( cells < count*2 && cells < (1u << 24))
+		cells <<= 1;
+	m_CellMask = cells - 1;
+	m_Radius = Max( radius, 1e-6f );
+	m_InvCellSize = 0.5f / m_Radius;
+
+	m_CellStart.assign( cells + 1, 0 );
+	for( int i=0; i<NUM_CHUNKS; ++i )
+		for( size_t j=0; j<m_ChunkPhotons[i].size(); ++j ) {
+			const float3 & p = m_ChunkPhotons[i][j].p;
+			m_CellStart[GetCell( int( floorf( p.x * m_InvCellSize )), int( floorf( p.y * m_InvCellSize )), int( floorf( p.z * m_InvCellSize ))) + 1]++;
+		}
+	for( uint32 c=0; c<cells; ++c )
+		m_CellStart[c+1] += m_CellStart[c];
+
+	std::vector<int> next( m_CellStart.begin(), m_CellStart.end() - 1 );
+	m_Photons.resize( count );
+	for( int i=0; i<NUM_CHUNKS; ++i ) {
+		for( size_t j=0; j<m_ChunkPhotons[i].size(); ++j ) {
+			const Photon & ph = m_ChunkPhotons[i][j];
+			m_Photons[next[GetCell( int( floorf( ph.p.x * m_InvCellSize )), int( floorf( ph.p.y * m_InvCellSize )), int( floorf( ph.p.z * m_InvCellSize )))]++] = ph;
+		}
+		std::vector<Photon>().swap( m_ChunkPhotons[i] );
+	}
+
+	m_pRaytracer = NULL;
+	m_pScene = NULL;
+	m_pEnv = NULL;
+	m_Key = key;
+	m_bBuilt = true;
+	m_BuildSeconds = float( NanoCore::TickToMicroseconds( NanoCore::GetTicks() - t0 )) * 0.000001f;
+	NanoCore::DebugOutput( "Photon map: %d photons shot, %d stored in %0.2f s (%d Kb)\n", m_NumPhotons, GetPhotonCount(), m_BuildSeconds, int( GetMemoryUsage() / 1024 ));
+}
+
+uint32 PhotonMap::GetCell( int x, int y, int z ) const {
+	return NanoCore::Hash( NanoCore::Hash( uint32( x ), uint32( y )), uint32( z )) & m_CellMask;
+}
+
+void PhotonMap::EmitPhoton( int index, Ray & ray, float3 & power ) const {
+	if( index >= m_NumSunPhotons && index < m_NumSunPhotons + m_NumLightPhotons ) {
+		// emitters picked by their power, cosine-weighted directions from a uniform point of the triangle
+		const uint32 i = uint32( index - m_NumSunPhotons );
+		const LightTree * pLights = m_pEnv->pLights;
+		float pmf;
+		int light = pLights->PickByPower( NanoCore::SobolOwen2D( i, 0x3d4d51cbu ).x, pmf );
+		if( light < 0 ) {
+			power = float3( 0.0f );
+			return;
+		}
+		const LightTree::Emitter & e = pLights->GetEmitter( light );
+		float3 t, b;
+		orthonormalBasis( e.n, t, b );
+		float3 d = SampleCosineHemisphere( NanoCore::SobolOwen2D( i, 0x0e2c4ab7u ));
+		float3 p = pLights->SamplePoint( light, NanoCore::SobolOwen2D( i, 0x5f356495u ));
+		ray = Ray( p + e.n * 0.001f, t * d.x + b * d.y + e.n * d.z, Ray::eGI );
+		power = e.Le * (M_PI * e.area / (pmf * float( m_NumLightPhotons )));
+		return;
+	}
+
+	// parallel rays towards the scene, from a disk facing the light just outside of the bounding sphere
+	const bool bSun = index < m_NumSunPhotons;
+	const uint32 i = uint32( bSun ? index : index - m_NumSunPhotons - m_NumLightPhotons );
+	float3 toLight = m_SunDir;
+	power = m_SunPower;
+	if( !bSun ) {
+		// sky directions drawn from its radiance, or uniformly over the sphere for the uniform sky
+		float2 u = NanoCore::SobolOwen2D( i, 0x2c1b3c6du );
+		float pdf = 1.0f / (4.0f * M_PI);
+		if( m_pEnv->pSkyMap )
+			toLight = m_pEnv->pSkyMap->Sample( u, pdf );
+		else
+			toLight = SampleUniformSphere( u );
+		power = pdf > 0.0f ? m_pEnv->GetSkyRadiance( toLight ) * (m_SkyScale / pdf) : float3( 0.0f );
+	}
+	float2 d = SampleConcentricDisk( NanoCore::SobolOwen2D( i, bSun ? 0x297a2d39u : 0x1b56c4e9u ));
+	float3 t, b;
+	orthonormalBasis( toLight, t, b );
+	ray = Ray( m_Center + (toLight + t * d.x + b * d.y) * m_SceneRadius, -toLight, Ray::eGI );
+}
+
+void PhotonMap::TraceChunk( int chunk ) {
+	std::vector<Photon> & photons = m_ChunkPhotons[chunk];
+	photons.clear();
+	NanoCore::Random random( uint64( chunk ) + 1 );
+
+	const int begin = int( int64( m_NumPhotons ) * chunk / NUM_CHUNKS ), end = int( int64( m_NumPhotons ) * (chunk+1) / NUM_CHUNKS );
+	for( int i=begin; i<end; ++i ) {
+		Ray ray;
+		float3 power;
+		EmitPhoton( i, ray, power );
+		if( power.x + power.y + power.z <= 0.0f )
+			continue;
+
+		for( int depth=0;; ++depth ) {
+			IntersectResult hit;
+			if( !m_pRaytracer->TraceRay( ray, hit ))
+				break;
+			// back faces are not lit by the shaders either
+			if( dot( ray.dir, hit.n ) >= 0.0f )
+				break;
+			m_pScene->InterpolateTriangleAttributes( hit, IntersectResult::eNormal | IntersectResult::eUV );
+			float3 N = hit.GetInterpolatedNormal();
+
+			if( depth > 0 ) {
+				photons.push_back( Photon() );
+				Photon & ph = photons.back();
+				ph.p = hit.hit;
+				ph.power = power;
+				Quantize( -ray.dir, ph.wi );
+				Quantize( N, ph.n );
+				ph.depth = uint8( Min( depth, 255 ));
+				ph.pad = 0;
+			}
+			if( depth >= m_MaxDepth )
+				break;
+
+			// diffuse reflection, the survivors of the Russian roulette carry the power of the absorbed ones
+			ShadingPoint sp;
+			sp.Init( *hit.material, hit.GetUV() );
+			float q = Min( Max( sp.albedo.x, Max( sp.albedo.y, sp.albedo.z )), 0.95f );
+			if( random.NextFloat() >= q )
+				break;
+			power = power * sp.albedo * (1.0f / q);
+
+			float3 T, B;
+			orthonormalBasis( N, T, B );
+			float3 d = SampleCosineHemisphere( float2( random.NextFloat(), random.NextFloat() ));
+			float3 L = T * d.x + B * d.y + N * d.z;
+			if( dot( L, hit.n ) <= 0.0f )
+				break;
+			ray = Ray( hit.hit, L, Ray::eGI );
+		}
+	}
+}
+
+float3 PhotonMap::GetIrradiance( float3 p, float3 n, int maxDepth ) const {
+	if( m_Photons.empty() || maxDepth <= 0 )
+		return float3( 0.0f );
+
+	// the disk of radius r around p overlaps at most 2 cells per axis, distinct cells may share a hash entry
+	const int x0 = int( floorf( (p.x - m_Radius) * m_InvCellSize ));
+	const int y0 = int( floorf( (p.y - m_Radius) * m_InvCellSize ));
+	const int z0 = int( floorf( (p.z - m_Radius) * m_InvCellSize ));
+	uint32 visited[8];
+	int numVisited = 0;
+
+	const float r2 = m_Radius * m_Radius;
+	float3 sum( 0.0f );
+	for( int c=0; c<8; ++c ) {
+		uint32 cell = GetCell( x0 + (c & 1), y0 + ((c >> 1) & 1), z0 + (c >> 2) );
+		bool bVisited = false;
+		for( int i=0; i<numVisited; ++i )
+			bVisited = bVisited || visited[i] == cell;
+		if( bVisited )
+			continue;
+		visited[numVisited++] = cell;
+
+		for( int i=m_CellStart[cell], end=m_CellStart[cell+1]; i<end; ++i ) {
+			const Photon & ph = m_Photons[i];
+			float3 d = ph.p - p;
+			if( dot( d, d ) > r2 || ph.depth > maxDepth )
+				continue;
+			// photons of the same surface side, close to the tangent plane
+			if( fabsf( dot( d, n )) > m_Radius * 0.25f || dot( Dequantize( ph.wi ), n ) <= 0.0f || dot( Dequantize( ph.n ), n ) < 0.5f )
+				continue;
+			sum += ph.power;
+		}
+	}
+	return sum * (1.0f / (M_PI * r2));
+}
+
+size_t PhotonMap::GetMemoryUsage() const {
+	return m_Photons.capacity() * sizeof(Photon) + m_CellStart.capacity() * sizeof(int);
+}
@@ -0,0 +1,77 @@
+#ifndef ___INC_RAYTRACE_PHOTONMAP
+#define ___INC_RAYTRACE_PHOTONMAP
+
+#include "Common.h"
+
+#include <vector>
+
+
+
+/*
+	Photon map of the indirect light, built by a parallel pre-pass before the rendering. Photons are shot from
+	the sun and from the sky dome through a disk covering the scene, and from the emissive triangles, bounce diffusely with Russian roulette, and are
+	stored from their second hit on, so the map only holds light that was reflected at least once. The direct light
+	is always sampled by the shaders, a path ends at its first bounce with the density estimate of the map.
+
+	Photons are kept in a hashed grid whose cells are twice the gather radius wide, a lookup visits the 2x2x2 cells
+	overlapping its disk. The cells are sorted by a counting sort, so the grid is two flat arrays.
+*/
+class PhotonMap {
+public:
+	PhotonMap();
+	~PhotonMap();
+
+	// Shoots numPhotons photons in parallel jobs of the given type, blocks until the map is built. The photons are
+	// traced up to GIBounces reflections, maxDepth in GetIrradiance selects the ones that are needed by the vertex.
+	void Build( IRaytracer * pRaytracer, const IScene * pScene, const Environment & env, int numPhotons, float radius, uint32 key, int jobType );
+	void Clear();
+	bool IsBuilt( uint32 key ) const { return m_bBuilt && key == m_Key; }
+
+	// irradiance at p from the photons reflected at most maxDepth times, on the side of n
+	float3 GetIrradiance( float3 p, float3 n, int maxDepth ) const;
+
+	int    GetPhotonCount() const { return int( m_Photons.size() ); }
+	size_t GetMemoryUsage() const;
+	float  GetBuildSeconds() const { return m_BuildSeconds; }
+
+	void TraceChunk( int chunk );  // called by the build jobs
+
+private:
+	struct Photon {
+		float3 p;
+		float3 power;
+		int8   wi[3];  // direction towards the light, quantized
+		uint8  depth;  // reflections before the photon was stored
+		int8   n[3];   // normal of the surface the photon landed on
+		uint8  pad;
+	};
+
+	class TraceJob;
+
+	static const int NUM_CHUNKS = 64;
+
+	uint32 GetCell( int x, int y, int z ) const;
+	void   EmitPhoton( int index, Ray & ray, float3 & power ) const;
+
+	std::vector<Photon> m_Photons;     // sorted by cell
+	std::vector<int>    m_CellStart;   // first photon of each cell, m_CellStart[cell+1] is the end
+	std::vector<Photon> m_ChunkPhotons[NUM_CHUNKS];
+	uint32 m_CellMask;
+	float  m_Radius, m_InvCellSize;
+
+	// emission, valid during the build
+	IRaytracer *   m_pRaytracer;
+	const IScene * m_pScene;
+	const Environment * m_pEnv;
+	float3 m_Center;
+	float  m_SceneRadius;
+	float3 m_SunDir, m_SunPower;
+	float  m_SkyScale;  // flux of a sky photon is its radiance times this over its pdf
+	int    m_NumPhotons, m_NumSunPhotons, m_NumLightPhotons, m_MaxDepth;  // the emitter photons follow the sun ones
+
+	uint32 m_Key;
+	bool   m_bBuilt;
+	float  m_BuildSeconds;
+};
+
+#endif
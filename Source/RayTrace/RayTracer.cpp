@@ -1,7 +1,8 @@
 #include <NanoCore/Jobs.h>
 #include <NanoCore/Threads.h>
+#include <NanoCore/Random.h>
 #include "RayTracer.h"
-#include <stdlib.h>
+#include "ShaderPhoto.h"
 #include <NanoCore/File.h>
 #include <NanoCore/String.h>
 
@@ -13,15 +14,19 @@
 
 
 static void ComputeProgressiveDistribution( int size, std::vector<int> & order ) {
+	NanoCore::Random random;
 	for( int i=0; i<size*size; order.push_back( i++ ));
-	for( int i=0; i<size*size; ++i ) {
-		int a = rand() % (size*size);
-		int b = rand() % (size*size);
-		int temp = order[a]; order[a] = order[b]; order[b] = temp;
+	for( int i=size*size-1; i>0; --i ) {
+		int j = random.Next( i+1 );
+		int temp = order[i]; order[i] = order[j]; order[j] = temp;
 	}
 }
 
 bool Raytracer::TraceRay( Ray & V, IntersectResult & result ) {
+	RayStats::GetThreadStats().Add( RayStats::ECounter( RayStats::ePrimaryRays + V.type ), 1 );
+	// a ray shorter than INFINITE_HITLEN ends before a light, it keeps its end through the alpha tested hits
+	const float3 end = V.origin + V.dir * V.hitlen;
+	const bool bBounded = V.hitlen < INFINITE_HITLEN;
 	for( ;; ) {
 		m_pScene->IntersectRay( V, result );
 		if( !result.triangle || m_Materials.empty())
@@ -29,9 +34,10 @@ bool Raytracer::TraceRay( Ray & V, IntersectResult & result ) {
 
 		//return true;
 
-		const Texture::Ptr & tex = m_Materials[result.materialId].pAlphaMap;
-		if( !tex )
+		const Material & M = m_Materials[result.materialId];
+		if( !(M.features & Material::eFeatureAlpha) )
 			break;
+		const Texture::Ptr & tex = M.pAlphaMap;
 
 		m_pScene->InterpolateTriangleAttributes( result, IntersectResult::eUV );
 
@@ -41,14 +47,13 @@ bool Raytracer::TraceRay( Ray & V, IntersectResult & result ) {
 		int alpha = (tex->mips[0]->GetBpp() == 32) ? pix[3] : pix[0];
 		if( alpha )
 			break;
-		/*if( V.hitlen < INFINITE_HITLEN )
-			V.hitlen -= len( V.origin - result.hit );
-		else*/
-			V.hitlen = INFINITE_HITLEN;
 
 		V.origin = result.hit + V.dir * 0.001f;
+		V.hitlen = bBounded ? dot( end - V.origin, V.dir ) : INFINITE_HITLEN;
 		result.triangle = NULL;
 		result.materialId = 0;
+		if( V.hitlen <= 0.0f )
+			return false;
 	}
 	if( dot( result.n, V.dir ) > 0.0f )
 		result.hit -= result.n * 0.001f;
@@ -58,31 +63,141 @@ bool Raytracer::TraceRay( Ray & V, IntersectResult & result ) {
 	return true;
 }
 
-static void Tonemap( const float3 & hdrColor, int * ldrColor ) {
-	float lum = Max( hdrColor.x, Max( hdrColor.y, hdrColor.z ));
-	float3 color = hdrColor * ( 1.0f / (1.0f + lum) );
-	ldrColor[0] = int(color.x*255.0f);
-	ldrColor[1] = int(color.y*255.0f);
-	ldrColor[2] = int(color.z*255.0f);
-}
-
-float3 Raytracer::RenderRay( Ray & V, IShader * pShader, void * context ) {
+float3 Raytracer::RenderRay( Ray & V, IShader * pShader, ShadingContext & context ) {
 	IntersectResult hit;
 	TraceRay( V, hit );
 	return pShader->Shade( V, hit , *m_pEnv, this, context );
 }
 
-void Raytracer::RaytracePixel( int x, int y, int * pixel )
+ShadingContext & Raytracer::GetThreadContext() {
+	int index = NanoCore::JobManager::GetCurrentThreadIndex();
+	return *m_Contexts[ (index >= 0 && index < MAX_THREADS) ? index : MAX_THREADS ];
+}
+
+float3 Raytracer::RaytracePixel( ShadingContext & context, int x, int y )
 {
 	if( x == m_DebugX && y == m_DebugY ) {
 		NanoCore::DebugOutput( "%d", 1 );
 	}
 
-	float3 dir = m_pCamera->ConstructRay( x, y, m_pImage->GetWidth(), m_pImage->GetHeight() );
-	Ray ri( m_pCamera->pos, dir );
+	context.sampler.Begin( x, y, m_Pass );
+	context.path.Reset();
+
+	float3 dir = m_Camera.ConstructRay( x, y, m_pImage->GetWidth(), m_pImage->GetHeight() );
+	Ray ri( m_Camera.pos, dir );
+
+	IntersectResult hit;
+	TracePrimaryRay( x, y, ri, hit );
+	return m_pShader->Shade( ri, hit, *m_pEnv, this, context );
+}
+
+bool Raytracer::TracePrimaryRay( int x, int y, Ray & ray, IntersectResult & result ) {
+	// every pixel is owned by a single tile job, so its entry is never accessed concurrently
+	GBufferEntry & entry = m_GBuffer[x + y*m_pImage->GetWidth()];
+	// reprojected hits stand in for the traced ones only in the first pass of the rendering that warped them
+	if( entry.hitlen < 0.0f || (entry.bReprojected && (!m_bUseReprojected || m_Pass > 0)) ) {
+		bool bHit = TraceRay( ray, result );
+		if( result.triangle )
+			m_pScene->InterpolateTriangleAttributes( result, IntersectResult::eUV | IntersectResult::eNormal );
+
+		entry.triangle = result.triangle;
+		entry.materialId = result.materialId;
+		entry.hit = result.hit;
+		entry.n = result.n;
+		entry.barycentric = result.barycentric;
+		if( result.triangle ) {
+			entry.normal = result.GetInterpolatedNormal();
+			entry.uv = result.GetUV();
+		}
+		entry.hitlen = ray.hitlen;
+		entry.bReprojected = false;
+		return bHit;
+	}
+
+	RayStats::GetThreadStats().Add( RayStats::eCachedPrimaryHits, 1 );
+	ray.hitlen = entry.hitlen;
+	result.triangle = entry.triangle;
+	result.materialId = entry.materialId;
+	result.hit = entry.hit;
+	result.n = entry.n;
+	result.barycentric = entry.barycentric;
+	if( !entry.triangle || m_Materials.empty() )
+		return false;
+	result.SetUV( entry.uv );
+	result.SetInterpolatedNormal( entry.normal );
+	result.material = &m_Materials[entry.materialId];
+	return true;
+}
+
+static bool IsSameCamera( const Camera & a, const Camera & b ) {
+	return a.pos.x == b.pos.x && a.pos.y == b.pos.y && a.pos.z == b.pos.z &&
+		a.at.x == b.at.x && a.at.y == b.at.y && a.at.z == b.at.z &&
+		a.up.x == b.up.x && a.up.y == b.up.y && a.up.z == b.up.z &&
+		a.right.x == b.right.x && a.right.y == b.right.y && a.right.z == b.right.z &&
+		a.fovy == b.fovy;
+}
+
+bool Raytracer::UpdateGBuffer( const Camera & camera, const IScene * pScene ) {
+	const size_t size = m_pImage->GetWidth() * m_pImage->GetHeight();
+	m_bUseReprojected = false;
+	// the replicas of the scene are rebuilt under every instance sharing it, so the version of the owner is checked
+	const int sceneVersion = m_pSceneOwner->m_SceneVersion;
+	if( m_bGBufferValid && m_pGBufferScene == pScene && m_GBufferSceneVersion == sceneVersion && m_GBuffer.size() == size ) {
+		if( IsSameCamera( m_GBufferCamera, camera )) {
+			m_ReprojectedPixels = 0;  // the rendering traces them again
+			return true;
+		}
+		if( m_bReprojection ) {
+			ReprojectGBuffer( camera );
+			return false;
+		}
+	}
+	m_GBuffer.assign( size, GBufferEntry() );
+	m_GBufferCamera = camera;
+	m_pGBufferScene = pScene;
+	m_GBufferSceneVersion = sceneVersion;
+	m_bGBufferValid = true;
+	m_ReprojectedPixels = 0;
+	return false;
+}
+
+// Forward splats the previous hits into the new view, keeping the closest one per pixel.
+// Disoccluded pixels and the sky stay empty and get traced.
+void Raytracer::ReprojectGBuffer( const Camera & camera ) {
+	const int w = m_pImage->GetWidth(), h = m_pImage->GetHeight();
+	std::vector<GBufferEntry> prev( w*h );
+	prev.swap( m_GBuffer );
+
+	m_ReprojectedPixels = 0;
+	for( size_t i=0; i<prev.size(); ++i ) {
+		const GBufferEntry & src = prev[i];
+		if( src.hitlen < 0.0f || !src.triangle )
+			continue;
+
+		float fx, fy;
+		if( !camera.Project( src.hit, w, h, fx, fy ))
+			continue;
+		int x = int( ncFloor( fx + 0.5f )), y = int( ncFloor( fy + 0.5f ));
+		if( x < 0 || y < 0 || x >= w || y >= h )
+			continue;
+
+		GBufferEntry & dst = m_GBuffer[x + y*w];
+		float hitlen = len( src.hit - camera.pos );
+		if( dst.hitlen >= 0.0f && dst.hitlen <= hitlen )
+			continue;
+		if( dst.hitlen < 0.0f )
+			m_ReprojectedPixels++;
+		dst = src;
+		dst.hitlen = hitlen;
+		dst.bReprojected = true;
+	}
 
-	float3 color = RenderRay( ri, m_pShader, m_pShader->CreateContext() );
-	Tonemap( color, pixel );
+	m_GBufferCamera = camera;
+	m_bUseReprojected = true;
+}
+
+void Raytracer::InvalidateGBuffer() {
+	m_bGBufferValid = false;
 }
 
 static std::vector<int> progressive_order;
@@ -90,10 +205,11 @@ static std::vector<int> progressive_order;
 class ProgressiveRaytraceJob : public NanoCore::IJob {
 public:
 	int tile_x, tile_y, index, id;
+	bool bConverged;
 	Raytracer * pRaytracer;
 
-	ProgressiveRaytraceJob():IJob(0) {}
-	ProgressiveRaytraceJob( int tile_x, int tile_y, Raytracer * ptr, int id ) : IJob(0), tile_x(tile_x), tile_y(tile_y), index(-1), pRaytracer(ptr), id(id) {}
+	ProgressiveRaytraceJob():IJob(Raytracer::eJobTile) {}
+	ProgressiveRaytraceJob( int tile_x, int tile_y, Raytracer * ptr, int id, EPriority priority ) : IJob(ptr->GetJobType(Raytracer::eJobTile),priority), tile_x(tile_x), tile_y(tile_y), index(-1), id(id), bConverged(false), pRaytracer(ptr) {}
 
 	virtual const wchar_t * GetName() { return L"ProgressiveRaytraceJob"; }
 
@@ -105,24 +221,43 @@ public:
 
 		JobsLog( "  prog[%d]: %d, %d, %d\n", id, tile_x, tile_y, index );
 
-		if( x < pRaytracer->m_pImage->GetWidth() && y < pRaytracer->m_pImage->GetHeight()) {
-			int rgb[3];
-			pRaytracer->RaytracePixel( x, y, rgb );
-			int t = rgb[0]; rgb[0] = rgb[2]; rgb[2] = t;
-			pRaytracer->m_pImage->SetPixel( x, y, rgb );
-			pRaytracer->m_PixelCompleteCount++;
+		if( x < pRaytracer->m_pImage->GetWidth() && y < pRaytracer->m_pImage->GetHeight() && pRaytracer->IsInCrop( x, y )) {
+			ShadingContext & context = pRaytracer->GetThreadContext();
+			context.arena.Reset();
+
+			float3 color = pRaytracer->RaytracePixel( context, x, y );
+			pRaytracer->m_FrameBuffer.AddSample( x, y, color );
+			RayStats::GetThreadStats().Add( RayStats::ePixels, 1 );
 		}
 	}
 };
 
-static std::vector<ProgressiveRaytraceJob> ProgJobs;
+// retires the tiles whose every pixel has its error estimate below the threshold, returns the number of retired tiles
+static int UpdateConvergedTiles( Raytracer * pRaytracer, std::vector<ProgressiveRaytraceJob> & ProgJobs ) {
+	const int tile_size = 1 << pRaytracer->m_ScreenTileSizePow2;
+	const FrameBuffer & fb = pRaytracer->m_FrameBuffer;
+	int converged = 0;
+	for( size_t i=0; i<ProgJobs.size(); ++i ) {
+		ProgressiveRaytraceJob & job = ProgJobs[i];
+		if( !job.bConverged ) {
+			int x0 = job.tile_x * tile_size, y0 = job.tile_y * tile_size;
+			int x1 = Min( x0 + tile_size, fb.GetWidth() ), y1 = Min( y0 + tile_size, fb.GetHeight() );
+			job.bConverged = fb.GetMaxError( x0, y0, x1, y1 ) < pRaytracer->m_AdaptiveThreshold;
+		}
+		if( job.bConverged )
+			converged++;
+	}
+	return converged;
+}
 
 class SpawnProgressiveJobsJob : public NanoCore::IJob {
 public:
-	SpawnProgressiveJobsJob() : IJob(1) {}
+	SpawnProgressiveJobsJob() : IJob(Raytracer::eJobSpawnTiles) {}
 	Raytracer * pRaytracer;
 	IStatusCallback * pCallback;
+	std::vector<ProgressiveRaytraceJob> ProgJobs;
 	virtual void Execute();
+	void PrintFinished( bool bOverBudget );
 	virtual const wchar_t * GetName() { return L"SpawnProgressiveJobs"; }
 };
 
@@ -131,91 +266,458 @@ void SpawnProgressiveJobsJob::Execute() {
 	max_index *= max_index;
 	int curr_order;
 
+	// all the jobs of the previous pass are finished at this point, so it is safe to start the next one
+	if( !ProgJobs.empty() && ProgJobs[0].index == max_index-1 ) {
+		// a round is one pixel of each tile, so the budget is checked between passes only, where every pixel has the
+		// same number of samples
+		const bool bLastPass = pRaytracer->m_MaxPasses && pRaytracer->m_Pass+1 >= pRaytracer->m_MaxPasses;
+		const bool bOverBudget = !bLastPass && pRaytracer->IsOverBudget();
+		if( bLastPass || bOverBudget ) {
+			pRaytracer->EndRender( pRaytracer->m_Pass+1 );
+			PrintFinished( bOverBudget );
+			return;
+		}
+		pRaytracer->m_Pass++;
+		for( size_t i=0; i<ProgJobs.size(); ++i )
+			ProgJobs[i].index = -1;
+		if( pRaytracer->m_AdaptiveThreshold > 0.0f && pRaytracer->m_Pass >= pRaytracer->m_AdaptiveMinPasses )
+			pRaytracer->m_ConvergedTiles = UpdateConvergedTiles( pRaytracer, ProgJobs );
+	}
+	// the tiles are retired between passes, or from the start of a partial rendering
+	if( !ProgJobs.empty() && pRaytracer->m_ConvergedTiles == int(ProgJobs.size()) ) {
+		pRaytracer->EndRender( pRaytracer->m_Pass );
+		PrintFinished( false );
+		return;
+	}
+
 	JobsLog( "SpawnProgressiveJobsJob: index = %d\n", ProgJobs[0].index );
 	for( size_t i=0; i<ProgJobs.size(); ++i ) {
 		curr_order = ++ProgJobs[i].index;
-		NanoCore::JobManager::AddJob( &ProgJobs[i] );
+		if( !ProgJobs[i].bConverged )
+			NanoCore::JobManager::AddJob( &ProgJobs[i] );
 	}
 
-	static uint64 t0;
-	if( curr_order == 0 )
-		t0 = NanoCore::GetTicks();
+	pRaytracer->m_FrameVersion++;
 
 	if( pCallback )
-		pCallback->SetStatus( "Rendering: %d %%, %0.2f s", curr_order * 100 / max_index, float( NanoCore::TickToMicroseconds( NanoCore::GetTicks() - t0 ) / 1000 ) *0.001f );
+		pCallback->SetStatus( "Rendering: pass %d, %d %%, %0.2f spp, %0.2f s, %0.2f Mrays/s, %d/%d tiles converged", pRaytracer->m_Pass+1, curr_order * 100 / max_index, pRaytracer->GetSamplesPerPixel(),
+			pRaytracer->GetRenderSeconds(), pRaytracer->GetRaysPerSecond() * 0.000001f, pRaytracer->m_ConvergedTiles, int(ProgJobs.size()) );
 
-	if( curr_order < max_index-1 ) {
-		JobsLog( "SpawnProgressiveJobsJob: adding self\n" );
-		NanoCore::JobManager::AddJob( this, 0 );
-	} else {
-		NanoCore::DebugOutput( "Rendering finished for %0.3f ms\n", float(NanoCore::TickToMicroseconds( NanoCore::GetTicks() - t0 )) / 1000.0f );
-	}
+	// the last round of the last pass is over when this job runs again
+	JobsLog( "SpawnProgressiveJobsJob: adding self\n" );
+	NanoCore::JobManager::AddJob( this, pRaytracer->GetJobType( Raytracer::eJobTile ));
 }
 
-static SpawnProgressiveJobsJob SpawnProgJobsJob;
+void SpawnProgressiveJobsJob::PrintFinished( bool bOverBudget ) {
+	float ms = pRaytracer->GetRenderSeconds() * 1000.0f;
+	NanoCore::DebugOutput( "Rendering finished for %0.3f ms%s, %0.2f samples per pixel\n", ms, bOverBudget ? " (budget reached)" : "", pRaytracer->GetSamplesPerPixel() );
+	pRaytracer->PrintStats();
+	pRaytracer->PrintNodeStats( ms * 0.001f );
+}
 
+static bool s_UsedSlots[Raytracer::MAX_INSTANCES];  // the slot of an instance is released by its destructor
+static int  s_LiveInstances = 0;                     // the last one shuts the workers down
 
 
 
 
 Raytracer::Raytracer() {
-	NanoCore::JobManager::Init( 0, 2 );
+	if( !s_LiveInstances++ ) {
+		NanoCore::JobManager::Init( 0, eJobTypeCount * MAX_INSTANCES );
+		RayStats::SetJobTypesPerBank( eJobTypeCount );
+	}
+	for( m_Slot=0; m_Slot<MAX_INSTANCES && s_UsedSlots[m_Slot]; ++m_Slot );
+	assert( m_Slot < MAX_INSTANCES && "too many Raytracer instances alive, they would share their job types" );
+	m_Slot = Min( m_Slot, MAX_INSTANCES-1 );
+	s_UsedSlots[m_Slot] = true;
+	m_JobTypes = m_Slot * eJobTypeCount;
+	m_pSpawnJob = new SpawnProgressiveJobsJob();
 	m_ScreenTileSizePow2 = 6;
 	m_NumThreads = 3;
+	m_ThreadAffinity = NanoCore::JobManager::eAffinityNone;
+	m_ReplicatedNodes = 1;
+	m_bSharedScene = false;
+	m_pSceneOwner = this;
+	m_SceneVersion = 0;
+	m_TotalPixelCount = 0;
+	m_RenderStartTicks = 0;
+	m_RenderEndTicks = 0;
+	m_CompletedPasses = 0;
+	memset( &m_StatsStart, 0, sizeof(m_StatsStart) );
+	m_pImage = NULL;
+	m_Pass = 0;
+	m_MaxPasses = 1;
+	m_FrameVersion = 0;
+	m_ResolvedVersion = 0;
+	m_bFinalResolved = true;
+	m_AdaptiveThreshold = 0.0f;
+	m_AdaptiveMinPasses = 4;
+	m_ConvergedTiles = 0;
+	m_TimeBudget = 0.0f;
+	m_RayBudget = 0;
+	m_bShowSampleDensity = false;
+	m_pGBufferScene = NULL;
+	m_GBufferSceneVersion = 0;
+	m_bGBufferValid = false;
+	m_bUseReprojected = false;
+	m_ReprojectedPixels = 0;
+	m_bReprojection = false;
+	m_UseWavefront = 0;
+	m_SortHits = 1;
+	m_bPartialRender = false;
+	m_CropX0 = m_CropY0 = m_CropX1 = m_CropY1 = 0;
+	m_SortRays = 1;
+	m_UseIrradianceCache = 0;
+	m_ICAccuracy = 0.25f;
+	m_ICSamples = 256;
+	m_UsePhotonMap = 0;
+	m_NumPhotons = 200000;
+	m_PhotonRadius = 0.005f;
+	m_UseLightTree = 1;
+	m_pEnv = NULL;
 	m_SelectedTriangle = -1;
-	ComputeProgressiveDistribution( 1 << m_ScreenTileSizePow2, progressive_order );
+	for( int i=0; i<=MAX_THREADS; ++i )
+		m_Contexts.push_back( new ShadingContext() );
+	if( progressive_order.empty() )
+		ComputeProgressiveDistribution( 1 << m_ScreenTileSizePow2, progressive_order );
 }
 
 Raytracer::~Raytracer() {
-	NanoCore::JobManager::Done();
+	if( --s_LiveInstances )
+		Stop();
+	else
+		NanoCore::JobManager::Done();
+	s_UsedSlots[m_Slot] = false;
+	delete m_pSpawnJob;
+	if( !m_wIrradianceCacheFile.empty() && m_IrradianceCache.IsModified() )
+		m_IrradianceCache.Save( m_wIrradianceCacheFile.c_str() );
+	for( size_t i=0; i<m_Contexts.size(); ++i )
+		delete m_Contexts[i];
+}
+
+IrradianceCache * Raytracer::GetIrradianceCache() {
+	return m_UseIrradianceCache && m_pEnv && m_pEnv->GIBounces > 0 ? &m_IrradianceCache : NULL;
+}
+
+const PhotonMap * Raytracer::GetPhotonMap() const {
+	return m_UsePhotonMap && m_pEnv && m_pEnv->GIBounces > 0 ? &m_PhotonMap : NULL;
 }
 
 void Raytracer::Stop() {
-	NanoCore::JobManager::Wait( NanoCore::JobManager::efClearPendingJobs | NanoCore::JobManager::efDisableJobAddition );
+	NanoCore::JobManager::Wait( NanoCore::JobManager::efClearPendingJobs | NanoCore::JobManager::efDisableJobAddition, m_JobTypes, eJobTypeCount );
 }
 
-void Raytracer::Render( Camera & camera, NanoCore::Image & image, IScene * pScene, const Environment & env, IShader * pShader, IStatusCallback * pCallback )
+bool Raytracer::BeginRender( const Camera & camera, NanoCore::Image & image, IScene * pScene, const Environment & env, IShader * pShader, int numPasses, bool bAllowPartial )
 {
 	if( pScene->IsEmpty())
-		return;
+		return false;
 
 	Stop();
 
-	if( NanoCore::JobManager::GetNumThreads() != m_NumThreads ) {
+	NanoCore::JobManager::EAffinity affinity = NanoCore::JobManager::EAffinity( Clamp( m_ThreadAffinity, 0, int(NanoCore::JobManager::eAffinityNumaNode) ));
+	if( NanoCore::JobManager::GetNumThreads() != m_NumThreads || NanoCore::JobManager::GetAffinity() != affinity ) {
+		// the workers are shared, so replacing them stops the renderings of every instance
+		NanoCore::JobManager::Wait( NanoCore::JobManager::efClearPendingJobs | NanoCore::JobManager::efDisableJobAddition );
 		NanoCore::JobManager::Done();
-		NanoCore::JobManager::Init( m_NumThreads, 2 );
+		NanoCore::JobManager::Init( m_NumThreads, eJobTypeCount * MAX_INSTANCES, affinity );
 	}
 
 	m_pScene = pScene;
 	m_pImage = &image;
-	m_pCamera = &camera;
-	m_pEnv = &env;
+	m_Camera = camera;
 	m_pShader = pShader;
 
-	pShader->BeginShading( env );
+	// the rendering works on its own copy of the environment, with the sky map resolved
+	m_Env = env;
+	if( env.SkyMap != m_SkyMapName ) {
+		m_SkyMapName = env.SkyMap;
+		m_SkyMap.Clear();
+		if( !m_SkyMapName.empty() ) {
+			const uint64 t0 = NanoCore::GetTicks();
+			if( m_SkyMap.Load( (m_wScenePath + NanoCore::StrMbsToWcs( m_SkyMapName.c_str() )).c_str() ))
+				NanoCore::DebugOutput( "Sky map '%s' loaded in %0.2f s\n", m_SkyMapName.c_str(), float( NanoCore::TickToMicroseconds( NanoCore::GetTicks() - t0 )) * 0.000001f );
+			else
+				NanoCore::DebugOutput( "Warning: FAILED to load the sky map '%s'\n", m_SkyMapName.c_str() );
+		}
+	}
+	m_Env.pSkyMap = m_SkyMap.IsLoaded() ? &m_SkyMap : NULL;
+	m_Lights.SetUseTree( m_UseLightTree != 0 );
+	m_Env.pLights = m_Lights.IsEmpty() ? NULL : &m_Lights;
+	m_pEnv = &m_Env;
+
+	if( !m_bSharedScene && m_ReplicatedNodes != NanoCore::JobManager::GetNumNodes() ) {
+		// the replicas are rebuilt under the instances sharing them
+		NanoCore::JobManager::Wait( NanoCore::JobManager::efClearPendingJobs | NanoCore::JobManager::efDisableJobAddition );
+		ReplicateForNumaNodes( NanoCore::JobManager::GetNumNodes() );
+	}
+	NanoCore::JobManager::ResetStats();
+
+	pShader->BeginShading( m_Env );
+
+	// the photon map is built once per scene and lighting, the paths gathered into the irradiance cache depend on it
+	const bool bPhotonMap = m_UsePhotonMap && m_Env.GIBounces > 0;
+	uint32 lightingKey = IrradianceCache::GetLightingKey( m_Env, m_Materials, bPhotonMap );
+	if( bPhotonMap ) {
+		AABB box = pScene->GetAABB();
+		float radius = m_PhotonRadius * len( box.max - box.min );
+		uint32 key = NanoCore::Hash( NanoCore::Hash( lightingKey, uint32( m_NumPhotons )), *(const uint32*)&radius );
+		if( !m_PhotonMap.IsBuilt( key ))
+			m_PhotonMap.Build( this, pScene, m_Env, m_NumPhotons, radius, key, GetJobType( eJobPhotons ));
+		lightingKey = NanoCore::Hash( lightingKey, key );
+	}
+	if( m_UseIrradianceCache )
+		m_IrradianceCache.Begin( pScene->GetAABB(), lightingKey, m_ICAccuracy, m_ICSamples );
+
+	const int w = m_pImage->GetWidth(), h = m_pImage->GetHeight();
+	const int tileSize = 1 << m_ScreenTileSizePow2;
+	const int tw = (w + tileSize-1) / tileSize, th = (h + tileSize-1) / tileSize;
+
+	// the image of the same view is kept until the new samples replace it
+	const bool bSameView = UpdateGBuffer( camera, pScene );
+	if( !bSameView )
+		m_pImage->Fill( 0 );
+
+	const bool bPartial = bAllowPartial && m_bPartialRender && bSameView && m_FrameBuffer.GetWidth() == w && m_FrameBuffer.GetHeight() == h &&
+		int(m_DirtyTiles.size()) == tw*th;
+	m_bPartialRender = false;
+	m_TotalPixelCount = 0;
+	if( bPartial ) {
+		for( int ty=0; ty<th; ++ty )
+			for( int tx=0; tx<tw; ++tx ) {
+				if( !m_DirtyTiles[tx + ty*tw] )
+					continue;
+				int x0 = Max( tx*tileSize, m_CropX0 ), y0 = Max( ty*tileSize, m_CropY0 );
+				int x1 = Min( Min( (tx+1)*tileSize, w ), m_CropX1 ), y1 = Min( Min( (ty+1)*tileSize, h ), m_CropY1 );
+				m_FrameBuffer.ClearRect( x0, y0, x1, y1 );
+				m_TotalPixelCount += Max( x1 - x0, 0 ) * Max( y1 - y0, 0 );
+			}
+	} else {
+		m_DirtyTiles.assign( tw*th, 1 );
+		m_CropX0 = m_CropY0 = 0;
+		m_CropX1 = w;
+		m_CropY1 = h;
+		m_FrameBuffer.Init( w, h );
+		m_TotalPixelCount = w * h;
+	}
 
-	int tileSize = 1 << m_ScreenTileSizePow2;
+	m_Pass = 0;
+	m_MaxPasses = numPasses;
+	m_ConvergedTiles = 0;
+	m_ResolvedVersion = m_FrameVersion;
+	m_bFinalResolved = false;
 
-	m_pImage->Fill( 0 );
+	RayStats::GetTotal( m_StatsStart, m_Slot );
+	m_RenderStartTicks = NanoCore::GetTicks();
+	m_RenderEndTicks = 0;
+	m_CompletedPasses = 0;
+	return true;
+}
 
-	m_PixelCompleteCount = 0;
-	m_TotalPixelCount = m_pImage->GetWidth() * m_pImage->GetHeight();
+void Raytracer::Render( const Camera & camera, NanoCore::Image & image, IScene * pScene, const Environment & env, IShader * pShader, IStatusCallback * pCallback, int numPasses, NanoCore::IJob::EPriority priority )
+{
+	if( !BeginRender( camera, image, pScene, env, pShader, numPasses, true ))
+		return;
 
+	int tileSize = 1 << m_ScreenTileSizePow2;
 	int tw = (m_pImage->GetWidth() + tileSize-1 ) / tileSize, th = (m_pImage->GetHeight() + tileSize - 1) / tileSize;
 
+	std::vector<ProgressiveRaytraceJob> & ProgJobs = m_pSpawnJob->ProgJobs;
 	ProgJobs.clear();
 	ProgJobs.reserve( tw*th );
 	for( int y=0; y<th; ++y )
 		for( int x=0; x<tw; ++x ) {
-			ProgJobs.push_back( ProgressiveRaytraceJob( x, y, this, x + y*tw ));
+			ProgJobs.push_back( ProgressiveRaytraceJob( x, y, this, x + y*tw, priority ));
+			// clean tiles are retired from the start, like the converged ones
+			if( !m_DirtyTiles[x + y*tw] ) {
+				ProgJobs.back().bConverged = true;
+				m_ConvergedTiles++;
+			}
+		}
+	m_pSpawnJob->SetType( GetJobType( eJobSpawnTiles ));
+	m_pSpawnJob->SetPriority( priority );
+	m_pSpawnJob->pRaytracer = this;
+	m_pSpawnJob->pCallback = pCallback;
+	NanoCore::JobManager::AddJob( m_pSpawnJob );
+}
+
+void Raytracer::RenderWavefront( const Camera & camera, NanoCore::Image & image, IScene * pScene, const Environment & env, ShaderPhoto * pShader, IStatusCallback * pCallback,
+	int numPasses, NanoCore::IJob::EPriority priority )
+{
+	// the stages trace the direct light of the camera hits only, a photo with GI bounces needs the photon map for the rest
+	if( env.GIBounces > 0 && !m_UsePhotonMap ) {
+		NanoCore::DebugOutput( "The wavefront renderer needs the photon map for the GI bounces, rendering per pixel\n" );
+		Render( camera, image, pScene, env, pShader, pCallback, numPasses, priority );
+		return;
+	}
+	if( !BeginRender( camera, image, pScene, env, pShader, numPasses, false ))
+		return;
+	m_WavefrontRenderer.Start( this, pShader, pCallback, priority );
+}
+
+void Raytracer::BeginPartialRender() {
+	const int tileSize = 1 << m_ScreenTileSizePow2;
+	const int w = m_FrameBuffer.GetWidth(), h = m_FrameBuffer.GetHeight();
+	const int tw = (w + tileSize-1) / tileSize, th = (h + tileSize-1) / tileSize;
+	if( m_bPartialRender && int(m_DirtyTiles.size()) == tw*th )
+		return;
+	m_DirtyTiles.assign( tw*th, 0 );
+	m_CropX0 = m_CropY0 = 0;
+	m_CropX1 = w;
+	m_CropY1 = h;
+	m_bPartialRender = true;
+}
+
+int Raytracer::MarkTile( int x, int y ) {
+	const int tileSize = 1 << m_ScreenTileSizePow2;
+	const int tw = (m_FrameBuffer.GetWidth() + tileSize-1) / tileSize;
+	uint8 & tile = m_DirtyTiles[(x >> m_ScreenTileSizePow2) + (y >> m_ScreenTileSizePow2) * tw];
+	int marked = tile ? 0 : 1;
+	tile = 1;
+	return marked;
+}
+
+void Raytracer::SetCropRegion( int x0, int y0, int x1, int y1 ) {
+	BeginPartialRender();
+	m_CropX0 = Max( x0, 0 );
+	m_CropY0 = Max( y0, 0 );
+	m_CropX1 = Min( x1, m_FrameBuffer.GetWidth() );
+	m_CropY1 = Min( y1, m_FrameBuffer.GetHeight() );
+	const int tileSize = 1 << m_ScreenTileSizePow2;
+	for( int y=m_CropY0 & ~(tileSize-1); y<m_CropY1; y+=tileSize )
+		for( int x=m_CropX0 & ~(tileSize-1); x<m_CropX1; x+=tileSize )
+			MarkTile( x, y );
+}
+
+// the g-buffer of the last rendering is the footprint of every tile: the triangle and the material of each primary hit
+int Raytracer::MarkMaterialTiles( int materialId ) {
+	BeginPartialRender();
+	const int w = m_FrameBuffer.GetWidth(), h = m_FrameBuffer.GetHeight();
+	if( m_GBuffer.size() != size_t(w*h) )
+		return 0;
+	int marked = 0;
+	for( int y=0; y<h; ++y )
+		for( int x=0; x<w; ++x ) {
+			const GBufferEntry & entry = m_GBuffer[x + y*w];
+			if( entry.hitlen >= 0.0f && entry.triangle && entry.materialId == materialId )
+				marked += MarkTile( x, y );
 		}
-	SpawnProgJobsJob.pRaytracer = this;
-	SpawnProgJobsJob.pCallback = pCallback;
-	NanoCore::JobManager::AddJob( &SpawnProgJobsJob );
+	return marked;
+}
+
+void Raytracer::ReplicateForNumaNodes( int numNodes ) {
+	m_pScene->Replicate( numNodes );
+	for( auto it = m_TextureMaps.begin(); it != m_TextureMaps.end(); ++it )
+		it->second->Replicate( numNodes );
+	m_ReplicatedNodes = numNodes;
+	m_SceneVersion++;
+}
+
+void Raytracer::PrintNodeStats( float seconds ) {
+	for( int node=0, n=NanoCore::JobManager::GetNumNodes(); node<n; ++node ) {
+		uint64 jobs = NanoCore::JobManager::GetNodeStats( node, NanoCore::JobManager::eNumJobs );
+		NanoCore::DebugOutput( "  node %d: %d threads, %lld jobs, %0.0f jobs/s\n", node,
+			int(NanoCore::JobManager::GetNodeStats( node, NanoCore::JobManager::eNumThreads )), jobs, seconds > 0.0f ? float(jobs) / seconds : 0.0f );
+	}
+}
+
+int Raytracer::GetProgress() const {
+	if( !m_TotalPixelCount )
+		return 0;
+	RayStats stats;
+	GetRenderStats( stats );
+	return int( Min( stats.Get( RayStats::ePixels ), int64(m_TotalPixelCount) ) * 100 / m_TotalPixelCount );
+}
+
+void Raytracer::ResolveImage() {
+	if( !m_pImage )
+		return;
+	// the last samples land after the last version bump, so resolve once more when the rendering is over
+	bool bRendering = IsRendering();
+	int version = m_FrameVersion;
+	if( version == m_ResolvedVersion && (bRendering || m_bFinalResolved) )
+		return;
+	m_ResolvedVersion = version;
+	m_bFinalResolved = !bRendering;
+	if( m_bShowSampleDensity )
+		m_FrameBuffer.ResolveSampleDensity( *m_pImage );
+	else
+		m_FrameBuffer.Resolve( *m_pImage );
+}
+
+void Raytracer::ShowSampleDensity( bool bShow ) {
+	m_bShowSampleDensity = bShow;
+	m_ResolvedVersion = -1;
+	m_bFinalResolved = false;
+}
+
+float Raytracer::GetSamplesPerPixel() const {
+	if( !m_TotalPixelCount )
+		return 0.0f;
+	RayStats stats;
+	GetRenderStats( stats );
+	return float( stats.Get( RayStats::ePixels )) / float( m_TotalPixelCount );
+}
+
+bool Raytracer::IsOverBudget() const {
+	if( m_MaxPasses )
+		return false;
+	if( m_TimeBudget > 0.0f && float( NanoCore::TickToMicroseconds( NanoCore::GetTicks() - m_RenderStartTicks )) * 0.000001f >= m_TimeBudget )
+		return true;
+	if( m_RayBudget > 0 ) {
+		RayStats stats;
+		GetRenderStats( stats );
+		if( stats.GetRays() >= int64( m_RayBudget ) * 1000000 )
+			return true;
+	}
+	return false;
+}
+
+void Raytracer::GetRenderStats( RayStats & stats ) const {
+	RayStats::GetTotal( stats, m_Slot );
+	for( int c=0; c<RayStats::eCount; ++c )
+		stats.counters[c] -= m_StatsStart.counters[c];
+}
+
+void Raytracer::EndRender( int completedPasses ) {
+	m_CompletedPasses = completedPasses;
+	m_RenderEndTicks = NanoCore::GetTicks();
+}
+
+float Raytracer::GetRenderSeconds() const {
+	uint64 end = m_RenderEndTicks ? m_RenderEndTicks : NanoCore::GetTicks();
+	return float( NanoCore::TickToMicroseconds( end - m_RenderStartTicks )) * 0.000001f;
+}
+
+float Raytracer::GetRaysPerSecond() const {
+	float seconds = GetRenderSeconds();
+	if( seconds <= 0.0f )
+		return 0.0f;
+	RayStats stats;
+	GetRenderStats( stats );
+	return float( stats.GetRays() ) / seconds;
+}
+
+void Raytracer::PrintStats() const {
+	RayStats stats;
+	GetRenderStats( stats );
+	int64 rays = Max( stats.GetRays(), int64(1) );
+	NanoCore::DebugOutput( "  %lld pixels, %lld primary rays, %lld cached primary hits, %lld shadow rays, %lld GI rays\n", stats.Get( RayStats::ePixels ),
+		stats.Get( RayStats::ePrimaryRays ), stats.Get( RayStats::eCachedPrimaryHits ), stats.Get( RayStats::eShadowRays ), stats.Get( RayStats::eGIRays ));
+	NanoCore::DebugOutput( "  %0.1f nodes/ray, %0.1f triangles/ray, %0.2f Mrays/s\n", float( stats.Get( RayStats::eNodesVisited )) / rays,
+		float( stats.Get( RayStats::eTrianglesTested )) / rays, GetRaysPerSecond() * 0.000001f );
+	if( stats.Get( RayStats::eShadedHits ))
+		NanoCore::DebugOutput( "  %lld shaded hits, %0.2f texture fetches/hit\n", stats.Get( RayStats::eShadedHits ),
+			float( stats.Get( RayStats::eTextureFetches )) / float( stats.Get( RayStats::eShadedHits )));
+	if( m_UseIrradianceCache )
+		NanoCore::DebugOutput( "  %d irradiance records (%d Kb)\n", m_IrradianceCache.GetRecordCount(), int( m_IrradianceCache.GetMemoryUsage() / 1024 ));
+	if( m_UsePhotonMap )
+		NanoCore::DebugOutput( "  %d photons (%d Kb), built in %0.2f s\n", m_PhotonMap.GetPhotonCount(), int( m_PhotonMap.GetMemoryUsage() / 1024 ), m_PhotonMap.GetBuildSeconds() );
+	if( !m_Lights.IsEmpty() )
+		NanoCore::DebugOutput( "  %d emissive triangles, picked %s\n", m_Lights.GetCount(), m_UseLightTree ? "by the light BVH" : "by power" );
 }
 
 bool Raytracer::IsRendering() {
-	return NanoCore::JobManager::IsRunning();
+	return NanoCore::JobManager::IsRunning( m_JobTypes, eJobTypeCount );
 }
 
 Texture::Ptr Raytracer::LoadTexture( std::wstring path, std::string file ) {
@@ -241,14 +743,59 @@ Texture::Ptr Raytracer::LoadTexture( std::wstring path, std::string file ) {
 	return NULL;
 }
 
+void Raytracer::GetOptions( std::vector<NanoCore::KeyValuePtr> & options, Environment & env ) {
+	options.push_back( NanoCore::KeyValuePtr( "Raytrace threads", m_NumThreads ));
+	options.push_back( NanoCore::KeyValuePtr( "Thread affinity", m_ThreadAffinity ));
+	options.push_back( NanoCore::KeyValuePtr( "Adaptive threshold", m_AdaptiveThreshold ));
+	options.push_back( NanoCore::KeyValuePtr( "Adaptive min passes", m_AdaptiveMinPasses ));
+	options.push_back( NanoCore::KeyValuePtr( "Time budget", m_TimeBudget ));
+	options.push_back( NanoCore::KeyValuePtr( "Ray budget", m_RayBudget ));
+	options.push_back( NanoCore::KeyValuePtr( "Wavefront", m_UseWavefront ));
+	options.push_back( NanoCore::KeyValuePtr( "Sort hits", m_SortHits ));
+	options.push_back( NanoCore::KeyValuePtr( "Sort rays", m_SortRays ));
+	options.push_back( NanoCore::KeyValuePtr( "Irradiance cache", m_UseIrradianceCache ));
+	options.push_back( NanoCore::KeyValuePtr( "IC accuracy", m_ICAccuracy ));
+	options.push_back( NanoCore::KeyValuePtr( "IC samples", m_ICSamples ));
+	options.push_back( NanoCore::KeyValuePtr( "Photon map", m_UsePhotonMap ));
+	options.push_back( NanoCore::KeyValuePtr( "Photons", m_NumPhotons ));
+	options.push_back( NanoCore::KeyValuePtr( "Photon radius", m_PhotonRadius ));
+	options.push_back( NanoCore::KeyValuePtr( "Light BVH", m_UseLightTree ));
+	options.push_back( NanoCore::KeyValuePtr( "GI bounces", env.GIBounces ));
+	options.push_back( NanoCore::KeyValuePtr( "GI samples", env.GISamples ));
+	options.push_back( NanoCore::KeyValuePtr( "Sun samples", env.SunSamples ));
+	options.push_back( NanoCore::KeyValuePtr( "BRDF samples", env.BRDFSamples ));
+	options.push_back( NanoCore::KeyValuePtr( "Light samples", env.LightSamples ));
+	options.push_back( NanoCore::KeyValuePtr( "Sun disk angle", env.SunDiskAngle ));
+	options.push_back( NanoCore::KeyValuePtr( "Sun angle 1", env.SunAngle1 ));
+	options.push_back( NanoCore::KeyValuePtr( "Sun angle 2", env.SunAngle2 ));
+	options.push_back( NanoCore::KeyValuePtr( "Sun strength", env.SunStrength ));
+	options.push_back( NanoCore::KeyValuePtr( "Sky strength", env.SkyStrength ));
+	options.push_back( NanoCore::KeyValuePtr( "Sky map", env.SkyMap ));
+}
+
 void Raytracer::LoadMaterials( ISceneLoader * pLoader, IStatusCallback * pCallback ) {
 	std::wstring path = NanoCore::StrGetPath( pLoader->GetFilename() );
 	int num = pLoader->GetNumMaterials();
 	m_Materials.resize( num );
+	InvalidateGBuffer();
 
 	m_ImageCountLoaded = 0;
 	m_ImageSizeLoaded = 0;
 	m_TextureMaps.clear();
+	m_ReplicatedNodes = 1;
+	m_PhotonMap.Clear();
+
+	// the sky map is looked up next to the model, it is loaded again by the next rendering
+	m_wScenePath = path;
+	m_SkyMapName.clear();
+	m_SkyMap.Clear();
+
+	// the records of the previous scene are kept on disk, the ones of this scene are reused until its lighting changes
+	if( !m_wIrradianceCacheFile.empty() && m_IrradianceCache.IsModified() )
+		m_IrradianceCache.Save( m_wIrradianceCacheFile.c_str() );
+	m_wIrradianceCacheFile = std::wstring( pLoader->GetFilename() ) + L".irrcache";
+	if( !m_IrradianceCache.Load( m_wIrradianceCacheFile.c_str() ))
+		m_IrradianceCache.Clear();
 
 	for( int i=0; i<num; ++i ) {
 		auto src = pLoader->GetMaterial(i);
@@ -270,10 +817,25 @@ void Raytracer::LoadMaterials( ISceneLoader * pLoader, IStatusCallback * pCallba
 		dst.pRoughnessMap = LoadTexture( path, src->mapNs );
 		if( !dst.pAlphaMap && dst.pDiffuseMap && dst.pDiffuseMap->mips[0]->GetBpp() == 32 )
 			dst.pAlphaMap = dst.pDiffuseMap;
+		dst.UpdateFeatures();
 	}
 	NanoCore::DebugOutput( "%d materials loaded\n", num );
+	m_Lights.Build( pLoader, m_Materials );
 	NanoCore::DebugOutput( "%d images loaded (%d Mb)\n", m_ImageCountLoaded, m_ImageSizeLoaded / (1024*1024) );
 
 	if( pCallback )
 		pCallback->SetStatus( NULL );
+}
+
+// the textures are reference counted, so both instances use the same images; the sky map is loaded by each of them
+void Raytracer::ShareScene( const Raytracer & owner ) {
+	m_Materials = owner.m_Materials;
+	m_TextureMaps = owner.m_TextureMaps;
+	m_Lights = owner.m_Lights;
+	m_wScenePath = owner.m_wScenePath;
+	m_SkyMapName.clear();
+	m_SkyMap.Clear();
+	m_bSharedScene = true;
+	m_pSceneOwner = &owner;
+	InvalidateGBuffer();
 }
\ No newline at end of file
@@ -2,58 +2,217 @@
 #define ___INC_RAYTRACE_RAYTRACER
 
 #include <NanoCore/Image.h>
+#include <NanoCore/Jobs.h>
+#include <NanoCore/Serialize.h>
 #include "Common.h"
 #include "Camera.h"
+#include "FrameBuffer.h"
+#include "IrradianceCache.h"
+#include "PhotonMap.h"
+#include "EnvironmentMap.h"
+#include "LightTree.h"
+#include "ShadingContext.h"
+#include "WavefrontRenderer.h"
 
 #include <vector>
 #include <map>
 #include <string>
 
+class SpawnProgressiveJobsJob;
+
 
 
 
 class Raytracer : public IRaytracer
 {
 public:
+	enum EJobType {
+		eJobTile,       // one sample of a progressive tile
+		eJobSpawnTiles, // queues the next round of tile jobs
+		eJobKernel,     // a chunk of a wavefront stage
+		eJobStage,      // dispatches the next wavefront stage
+		eJobPhotons,    // a chunk of the photon map pre-pass
+		eJobTypeCount
+	};
+	// every instance queues its jobs under its own types, so the instances render side by side, e.g. the preview next to
+	// a photo, and each one waits for, stops and counts the rays of only its own jobs; this many instances may live at once
+	static const int MAX_INSTANCES = RayStats::MAX_BANKS;
+
 	int m_ScreenTileSizePow2;
 
 	Raytracer();
 	virtual ~Raytracer();
 
 	virtual bool   TraceRay( Ray & V, IntersectResult & result );
-	virtual float3 RenderRay( Ray & V, IShader * pShader, void * context );
+	virtual float3 RenderRay( Ray & V, IShader * pShader, ShadingContext & context );
 	virtual const IScene * GetScene() const { return m_pScene; }
+	virtual IrradianceCache * GetIrradianceCache();
+	virtual const PhotonMap * GetPhotonMap() const;
 
 	void LoadMaterials( ISceneLoader * pLoader, IStatusCallback * pCallback );
-	void Render( Camera & camera, NanoCore::Image & image, IScene * pScene, const Environment & env, IShader * pShader, IStatusCallback * pCallback );
+	void ShareScene( const Raytracer & owner );  // renders the materials and the lights loaded by another instance, which replicates them
+	// binds the rendering options and the environment to the "Environment" section of the scene files
+	void GetOptions( std::vector<NanoCore::KeyValuePtr> & options, Environment & env );
+	// numPasses == 0 keeps refining the image until Stop() is called
+	void Render( const Camera & camera, NanoCore::Image & image, IScene * pScene, const Environment & env, IShader * pShader, IStatusCallback * pCallback,
+		int numPasses = 1, NanoCore::IJob::EPriority priority = NanoCore::IJob::ePriorityNormal );
+	// photo rendering through the wavefront pipeline: the direct light of the camera hits, and the photon map irradiance
+	// at the camera hits as their diffuse indirect light; unlike pShader it does no final gather bounce, no specular or
+	// glossy indirect light and no irradiance cache, so the image is darker in the reflections and shows the blotches
+	// of the photon map; with GI bounces and no photon map it renders through Render instead
+	void RenderWavefront( const Camera & camera, NanoCore::Image & image, IScene * pScene, const Environment & env, ShaderPhoto * pShader, IStatusCallback * pCallback,
+		int numPasses = 1, NanoCore::IJob::EPriority priority = NanoCore::IJob::ePriorityNormal );
 	bool IsRendering();
-	void Stop();
-
-	void RaytracePixel( int x, int y, int * pixel );
-
-	int GetProgress() const { return m_PixelCompleteCount * 100 / m_TotalPixelCount; }
-
-	volatile int m_PixelCompleteCount;
-	int          m_TotalPixelCount;
+	int  GetJobType( EJobType type ) const { return m_JobTypes + type; }
+
+	// Partial re-rendering, consumed by the next Render of the same view: only the marked tiles are rendered again,
+	// restricted to the crop rectangle, and the samples of all the other pixels are kept.
+	void SetCropRegion( int x0, int y0, int x1, int y1 );  // [x0,x1) x [y0,y1) in image pixels
+	int  MarkMaterialTiles( int materialId );               // after an edit of the material, the tiles whose primary hits use it, returns their number
+	bool IsInCrop( int x, int y ) const { return x >= m_CropX0 && y >= m_CropY0 && x < m_CropX1 && y < m_CropY1; }
+	void Stop();  // the renderings of the other instances keep running
+
+	void   InvalidateGBuffer();  // the primary hits are kept while the camera, the scene and the image size stay the same
+	int    GetReprojectedPixels() const { return m_ReprojectedPixels; }  // pixels of the last rendering whose primary hit was only reprojected
+	void   ResolveImage();  // tonemaps the accumulated samples into the image passed to Render, if there are new ones
+	void   ShowSampleDensity( bool bShow );  // resolves the number of samples per pixel instead of the colors
+	bool   IsShowingSampleDensity() const { return m_bShowSampleDensity; }
+	float3 RaytracePixel( ShadingContext & context, int x, int y );
+	int    GetPass() const { return m_Pass; }
+	int    GetCompletedPasses() const { return m_CompletedPasses; }  // passes that covered every pixel, set when the rendering ends
+	void   EndRender( int completedPasses );  // called by the last job of the rendering
+
+	ShadingContext & GetThreadContext();
+	const Environment & GetEnvironment() const { return *m_pEnv; }
+
+	int   GetProgress() const;
+	float GetRenderSeconds() const;  // until the rendering ended, or so far
+	float GetRaysPerSecond() const;
+	float GetSamplesPerPixel() const;  // achieved so far, averaged over the whole image
+	// counted by the jobs of this instance since the rendering began
+	void  GetRenderStats( RayStats & stats ) const;
+	bool  IsOverBudget() const;
+	void  PrintStats() const;
+
+	int    m_TotalPixelCount;
+	uint64 m_RenderStartTicks;
+	uint64 m_RenderEndTicks;  // 0 while rendering
+	int    m_CompletedPasses;
+
+	FrameBuffer  m_FrameBuffer;
+	volatile int m_Pass;
+	int          m_MaxPasses;
+	volatile int m_FrameVersion;
+	int          m_ResolvedVersion;
+	bool         m_bFinalResolved;
+
+	// adaptive sampling: after m_AdaptiveMinPasses the tiles whose pixels all have their error below the threshold stop
+	// receiving samples, the error is the standard error of the tonemapped pixel mean, 0 disables it
+	float m_AdaptiveThreshold;
+	int   m_AdaptiveMinPasses;
+	int   m_ConvergedTiles;
+
+	// budgets stop an open-ended rendering (numPasses == 0) at the end of a pass, 0 means unlimited
+	float m_TimeBudget;  // wall-clock seconds
+	int   m_RayBudget;   // millions of rays of all the types
+
+	int  m_UseWavefront;  // MainWnd renders photos through RenderWavefront when set
+	int  m_SortHits;      // the wavefront renderer shades the hits grouped by material and UV region
+	int  m_SortRays;      // the wavefront renderer bins the secondary rays by direction and origin before tracing them
+	// warps the primary hits of the previous camera into a new one, instead of tracing them again; the warped hits are
+	// shaded by the first pass and stay in the accumulated image, so it is off by default and meant for the preview
+	bool m_bReprojection;
+
+	// the diffuse indirect light of the camera hits is interpolated from an irradiance cache, saved next to the scene
+	int   m_UseIrradianceCache;
+	float m_ICAccuracy;  // maximum interpolation error of a record, smaller values place more records
+	int   m_ICSamples;   // rays gathered per record
+
+	// the paths end at their first bounce with the irradiance of a photon map, built before the rendering
+	int   m_UsePhotonMap;
+	int   m_NumPhotons;
+	float m_PhotonRadius;  // gather radius, relative to the scene diagonal
+
+	int m_UseLightTree;  // the emissive triangles are picked by the light BVH instead of by their power alone
 
 	int m_NumThreads;
+	int m_ThreadAffinity;  // NanoCore::JobManager::EAffinity: 0 - none, 1 - core, 2 - SMT, 3 - NUMA node
 
 	int m_SelectedTriangle, m_DebugX, m_DebugY;
 
 	NanoCore::Image * m_pImage;
-	Camera * m_pCamera;
+	Camera m_Camera;  // copy taken by BeginRender, so the caller moves its camera freely while the jobs render this one
 	IScene * m_pScene;
 
 	std::vector<Material> m_Materials;
 	std::map<std::wstring,Texture::Ptr> m_TextureMaps;
 
+	void PrintNodeStats( float seconds );
+
 private:
+	// primary hit of a pixel, enough to rebuild the IntersectResult without tracing the ray again
+	struct GBufferEntry {
+		const void * triangle;
+		int    materialId;
+		float  hitlen;  // < 0 when the entry is not filled yet
+		float3 hit, n, barycentric, normal;
+		float2 uv;
+		bool   bReprojected;  // hit of a neighbouring ray warped from the previous camera, traced again by later renderings
+
+		GBufferEntry() : triangle(NULL), materialId(0), hitlen(-1.0f), bReprojected(false) {}
+	};
+
+	bool BeginRender( const Camera & camera, NanoCore::Image & image, IScene * pScene, const Environment & env, IShader * pShader, int numPasses, bool bAllowPartial );
+	void BeginPartialRender();
+	int  MarkTile( int x, int y );  // 1 when the tile of the pixel was not marked yet
+
 	Texture::Ptr LoadTexture( std::wstring path, std::string file );
+	void ReplicateForNumaNodes( int numNodes );
+	bool UpdateGBuffer( const Camera & camera, const IScene * pScene );  // true when the view did not change
+	void ReprojectGBuffer( const Camera & camera );
+	bool TracePrimaryRay( int x, int y, Ray & ray, IntersectResult & result );
+
+	int  m_ReplicatedNodes;
+	bool m_bSharedScene;  // the materials belong to another instance, which replicates them
+	const Raytracer * m_pSceneOwner;  // replicates the scene, this instance or the one it shares the scene of, which outlives it
+	int  m_SceneVersion;  // bumped by every replication, it frees the triangles the g-buffer entries point to
+	bool m_bShowSampleDensity;
+
+	int m_Slot;      // of the instance among the live ones, it selects the job types and the bank of the RayStats
+	int m_JobTypes;  // first of the eJobTypeCount job types of the instance
+	SpawnProgressiveJobsJob * m_pSpawnJob;  // queues the rounds of the progressive tile jobs, it owns them
+	RayStats m_StatsStart;
+
+	std::vector<GBufferEntry> m_GBuffer;
+	Camera         m_GBufferCamera;
+	const IScene * m_pGBufferScene;
+	int            m_GBufferSceneVersion;
+	bool           m_bGBufferValid;
+	bool           m_bUseReprojected;
+	int            m_ReprojectedPixels;
+
+	WavefrontRenderer m_WavefrontRenderer;
+
+	IrradianceCache m_IrradianceCache;
+	std::wstring    m_wIrradianceCacheFile;
+
+	PhotonMap m_PhotonMap;
+	LightTree m_Lights;
+
+	std::vector<uint8> m_DirtyTiles;  // tile grid of the last rendering, valid while m_bPartialRender is set
+	bool m_bPartialRender;
+	int  m_CropX0, m_CropY0, m_CropX1, m_CropY1;
+
+	std::vector<ShadingContext*> m_Contexts;  // one per worker thread, the last one is shared by non-worker threads
 
 	int m_ImageCountLoaded;
 	int m_ImageSizeLoaded;
 
 	const Environment * m_pEnv;
+	Environment    m_Env;         // copy of the environment of the rendering
+	EnvironmentMap m_SkyMap;
+	std::string    m_SkyMapName;  // Environment::SkyMap of the loaded map
+	std::wstring   m_wScenePath;
 	IShader * m_pShader;
 };
 
@@ -0,0 +1,53 @@
+#include "Sampler.h"
+
+
+
+Sampler::Sampler() : m_PixelSeed(0), m_Pass(0), m_Bounce(0) {}
+
+void Sampler::Begin( int x, int y, int pass ) {
+	m_PixelSeed = NanoCore::Hash( uint32(x), uint32(y) );
+	m_Pass = pass;
+	m_Bounce = 0;
+	m_Random.Seed( m_PixelSeed, uint64(pass) );
+}
+
+void Sampler::Fork( uint32 stream ) {
+	m_PixelSeed = NanoCore::Hash( m_PixelSeed, NanoCore::Hash( stream ^ uint32( m_Bounce ), 0x9e3779b9u ));
+	m_Bounce = 0;
+}
+
+float2 Sampler::Get2D( int dimension, int index, int count ) const {
+	return NanoCore::SobolOwen2D( uint32( m_Pass*count + index ), NanoCore::Hash( m_PixelSeed, uint32( dimension + m_Bounce * DIMENSIONS_PER_BOUNCE )));
+}
+
+
+
+float3 SampleUniformSphere( float2 u ) {
+	float z = 1.0f - 2.0f * u.x;
+	float r = ncSqrt( Max( 0.0f, 1.0f - z*z ));
+	float s, c;
+	ncSinCos( 2.0f * M_PI * u.y, s, c );
+	return float3( r*c, r*s, z );
+}
+
+float2 SampleConcentricDisk( float2 u ) {
+	float a = 2.0f * u.x - 1.0f, b = 2.0f * u.y - 1.0f;
+	if( a == 0.0f && b == 0.0f )
+		return float2( 0.0f, 0.0f );
+	float r, phi;
+	if( a*a > b*b ) {
+		r = a;
+		phi = (M_PI * 0.25f) * (b / a);
+	} else {
+		r = b;
+		phi = (M_PI * 0.5f) - (M_PI * 0.25f) * (a / b);
+	}
+	float s, c;
+	ncSinCos( phi, s, c );
+	return float2( r*c, r*s );
+}
+
+float3 SampleCosineHemisphere( float2 u ) {
+	float2 d = SampleConcentricDisk( u );
+	return float3( d.x, d.y, ncSqrt( Max( 0.0f, 1.0f - d.x*d.x - d.y*d.y )));
+}
@@ -0,0 +1,37 @@
+#ifndef ___INC_RAYTRACE_SAMPLER
+#define ___INC_RAYTRACE_SAMPLER
+
+#include <NanoCore/Random.h>
+#include "Common.h"
+
+
+
+// Per pixel sample generator. Each (pixel, dimension) pair gets its own Owen-scrambled Sobol set,
+// so renders are deterministic and any pixel can be re-rendered in isolation with identical results.
+class Sampler {
+public:
+	Sampler();
+
+	void Begin( int x, int y, int pass );
+	void SetBounce( int bounce ) { m_Bounce = bounce; }  // each bounce of a path draws its own set of dimensions
+	void Fork( uint32 stream );  // independent samples for a sub-path started at the current vertex, e.g. a gather ray
+
+	// 'index'-th of 'count' well stratified points, consecutive passes continue the same sequence
+	float2 Get2D( int dimension, int index, int count ) const;
+
+	static const int DIMENSIONS_PER_BOUNCE = 16;
+
+	NanoCore::Random & GetRandom() { return m_Random; }
+
+private:
+	uint32 m_PixelSeed;
+	int    m_Pass;
+	int    m_Bounce;
+	NanoCore::Random m_Random;
+};
+
+float3 SampleUniformSphere( float2 u );
+float2 SampleConcentricDisk( float2 u );
+float3 SampleCosineHemisphere( float2 u );  // around +z, pdf is z / pi
+
+#endif
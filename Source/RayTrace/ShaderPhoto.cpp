@@ -1,115 +1,433 @@
 #include "ShaderPhoto.h"
+#include "ShadingContext.h"
+#include "IrradianceCache.h"
+#include "PhotonMap.h"
+#include "EnvironmentMap.h"
+#include "LightTree.h"
 
 
 
-static float randf() {
-	return rand() / 32767.f;
-}
+void ShaderPhoto::BeginShading( const Environment & env ) {
+	m_SunDir = env.GetSunDir();
 
-static float randf( float a, float b ) {
-	return a + randf()*(b - a);
+	float s = sin( DEG2RAD(env.SunDiskAngle) * 0.25f );
+	m_SunOneMinusCos = 2.0f * s * s;  // precise for the tiny cone, 1 - cos(x) cancels in float
+	m_SunPdf = 1.0f / (2.0f * M_PI * m_SunOneMinusCos);
+	m_SunRadiance = env.SunColor * env.SunStrength * m_SunPdf;
 }
 
-static float3 randUnitSphere() {
-	float3 v( randf(-1.f, 1.f), randf(-1.f,1.f), randf(-1.f,1.f));
-	return normalize( v );
+static float PowerHeuristic( int n1, float pdf1, int n2, float pdf2 ) {
+	float a = float(n1) * pdf1, b = float(n2) * pdf2;
+	return a*a / Max( a*a + b*b, 1e-20f );
 }
 
 
-
-void ShaderPhoto::BeginShading( const Environment & env ) {
-	matrix m1, m2;
-	m1.setRotationAxis( float3(1,0,0), DEG2RAD(env.SunAngle1) );
-	m2.setRotationAxis( float3(0,0,1), DEG2RAD(env.SunAngle2) );
-	m_SunDir = m2 * m1 * float3(0,0,-1);
+// x^power of the lobe, without the special cases of powf
+static inline float SpecularPow( float x, float power ) {
+	return x > 0.0f ? exp2f( power * log2f( x )) : 0.0f;
 }
 
+// surface slope per unit of height between neighbouring texels of a bump map
+static const float BUMP_SLOPE = 4.0f;
+
+struct ShadingKernel {
+	void   (*Init)( ShadingPoint & sp, const Material & M, float2 uv );
+	float3 (*BRDF)( const ShadingPoint & sp, float3 V, float3 L, float3 N, float3 LightColor );
+	float3 (*Normal)( const Material & M, const IntersectResult & hit );
+	int    attributes;
+};
+
+// the material features are template constants, the tests of the features that are absent compile away
+template< int FEATURES >
+struct MaterialKernel {
+	static const int ATTRIBUTES = IntersectResult::eNormal | IntersectResult::eUV |
+		((FEATURES & (Material::eFeatureNormalMap | Material::eFeatureBumpMap)) ? IntersectResult::eTangentSpace : 0);
+
+	static void Init( ShadingPoint & sp, const Material & M, float2 uv ) {
+		int fetches = 1;
+		sp.albedo = M.pDiffuseMap->GetTexel( uv ) * M.Kd;
+		sp.bSpecular = (FEATURES & Material::eFeatureSpecular) != 0;
+		sp.power = M.Ns;
+		sp.specular = sp.albedo;
+		if( FEATURES & Material::eFeatureRoughnessMap ) {
+			float r = M.pRoughnessMap->GetTexel( uv ).x;
+			sp.power = (1.0f - r) * (1.0f - r) * 1000.0f;
+			fetches++;
+		}
+		if( FEATURES & Material::eFeatureSpecularMap ) {
+			sp.specular = M.pSpecularMap->GetTexel( uv );
+			fetches++;
+		}
+		sp.specNorm = (sp.power + 8.0f) / (M_PI*8.0f);
+
+		RayStats & stats = RayStats::GetThreadStats();
+		stats.Add( RayStats::eShadedHits, 1 );
+		stats.Add( RayStats::eTextureFetches, fetches );
+	}
 
-static float3 BRDF( float3 V, float3 L, float3 N, float3 LightColor, const Material & M, float2 uv ) {
-	float3 Albedo = M.pDiffuseMap->GetTexel( uv ) * M.Kd;
-	float3 Diffuse = LightColor * Albedo * Max( dot( N, L ), 0.0f );
+	static float3 BRDF( const ShadingPoint & sp, float3 V, float3 L, float3 N, float3 LightColor ) {
+		float cosL = Max( dot( N, L ), 0.0f );
+		float3 Contrib = LightColor * sp.albedo * (cosL / M_PI);
 
-	float3 Contrib(0,0,0);
+		if( FEATURES & Material::eFeatureSpecular ) {
+			float3 H = normalize( V + L );
+			float spec = SpecularPow( dot( N, H ), sp.power ) * sp.specNorm * cosL;
+			Contrib += sp.specular * LightColor * spec;
+		}
+		return Contrib;
+	}
 
-	Contrib += Diffuse;
+	static float3 Normal( const Material & M, const IntersectResult & hit ) {
+		float3 N = hit.GetInterpolatedNormal();
+		if( FEATURES & Material::eFeatureNormalMap ) {
+			float3 c = M.pBumpMap->GetTexel( hit.GetUV() ) * 2.0f - float3( 1.0f );
+			N = normalize( hit.GetTangent() * c.x + hit.GetBitangent() * c.y + N * c.z );
+			RayStats::GetThreadStats().Add( RayStats::eTextureFetches, 1 );
+		} else if( FEATURES & Material::eFeatureBumpMap ) {
+			// height differences towards the next texels along u and v tilt the normal against the tangent frame
+			const Texture & map = *M.pBumpMap;
+			const float2 uv = hit.GetUV();
+			float h = map.GetTexel( uv ).x;
+			float du = map.GetTexel( uv + float2( 1.0f / float( Max( map.width-1, 1 )), 0.0f )).x - h;
+			float dv = map.GetTexel( uv + float2( 0.0f, 1.0f / float( Max( map.height-1, 1 )))).x - h;
+			N = normalize( N - (hit.GetTangent() * du + hit.GetBitangent() * dv) * BUMP_SLOPE );
+			RayStats::GetThreadStats().Add( RayStats::eTextureFetches, 3 );
+		}
+		return N;
+	}
+};
+
+// one kernel per combination of the shading features, indexed by Material::features & eFeatureShading
+template< int FEATURES >
+struct KernelTable {
+	static void Fill( ShadingKernel * kernels ) {
+		ShadingKernel & k = kernels[FEATURES];
+		k.Init = MaterialKernel<FEATURES>::Init;
+		k.BRDF = MaterialKernel<FEATURES>::BRDF;
+		k.Normal = MaterialKernel<FEATURES>::Normal;
+		k.attributes = MaterialKernel<FEATURES>::ATTRIBUTES;
+		KernelTable<FEATURES-1>::Fill( kernels );
+	}
+};
 
-	if( M.Ns > 0.0f || M.pRoughnessMap ) {
-		float3 H = normalize( V + L );
-		float spec = Max( dot( N, H ), 0.0f );
+template<>
+struct KernelTable<-1> {
+	static void Fill( ShadingKernel * ) {}
+};
 
-		if( M.pRoughnessMap ) {
-			float r = M.pRoughnessMap->GetTexel( uv ).x;
-			float power = (1.0f - r);
-			power = ncPow( power, 2.0f );
-			power *= 1000.0f;
+static ShadingKernel s_Kernels[Material::eFeatureShading + 1];
 
-			spec = ncPow( spec, power ) * (power + 8.0f) / (M_PI*8.0f);
-		} else {
-			spec = ncPow( spec, M.Ns );
-		}
+static struct KernelTableInit {
+	KernelTableInit() { KernelTable<Material::eFeatureShading>::Fill( s_Kernels ); }
+} s_KernelTableInit;
 
-		float3 SpecMap(0,0,0); // = M.Ks;
-		if( M.pSpecularMap )
-			SpecMap = M.pSpecularMap->GetTexel( uv );
-		else
-			SpecMap = Albedo;
-		Contrib += SpecMap * LightColor * spec;
-	}
-	return Contrib;
+void ShadingPoint::Init( const Material & M, float2 uv ) {
+	kernel = &s_Kernels[M.features & Material::eFeatureShading];
+	kernel->Init( *this, M, uv );
 }
 
+float3 ShadingPoint::BRDF( float3 V, float3 L, float3 N, float3 LightColor ) const {
+	return kernel->BRDF( *this, V, L, N, LightColor );
+}
 
-float3 ShaderPhoto::Shade( Ray & ray, IntersectResult & result, const Environment & env, IRaytracer * pRaytracer, void * context ) {
+float3 ShadingPoint::GetNormal( const Material & M, const IntersectResult & hit ) const {
+	return kernel->Normal( M, hit );
+}
 
-	float3 Sky = env.SkyColor * env.SkyStrength;
+int ShadingPoint::GetAttributes( const Material & M ) {
+	return s_Kernels[M.features & Material::eFeatureShading].attributes;
+}
 
-	if( !result.triangle )
-		return Sky;
+float3 ShadingPoint::SampleBRDF( float2 u, float3 V, float3 N ) const {
+	float cosH = ncPow( u.x, 1.0f / (power + 1.0f) );
+	float sinH = ncSqrt( Max( 0.0f, 1.0f - cosH*cosH ));
+	float s, c;
+	ncSinCos( 2.0f * M_PI * u.y, s, c );
+	float3 T, B;
+	orthonormalBasis( N, T, B );
+	float3 H = T * (sinH * c) + B * (sinH * s) + N * cosH;
+	return H * (2.0f * dot( V, H )) - V;
+}
 
-	pRaytracer->GetScene()->InterpolateTriangleAttributes( result, IntersectResult::eNormal | IntersectResult::eUV | IntersectResult::eTangentSpace );
+float ShadingPoint::BRDFPdf( float3 V, float3 L, float3 N ) const {
+	float3 H = normalize( V + L );
+	float cosH = dot( N, H ), VdotH = dot( V, H );
+	if( cosH <= 0.0f || VdotH <= 0.0f )
+		return 0.0f;
+	return (power + 1.0f) / (2.0f * M_PI) * SpecularPow( cosH, power ) / (4.0f * VdotH);
+}
 
-	float3 V = -ray.dir;
+bool ShadingPoint::SampleBounce( float2 u, float choice, float3 V, float3 N, float3 & L, float3 & weight ) const {
+	// picks the lobe proportionally to its reflectance
+	float kd = albedo.x + albedo.y + albedo.z, ks = bSpecular ? specular.x + specular.y + specular.z : 0.0f;
+	float specProb = (kd + ks > 0.0f) ? ks / (kd + ks) : 0.0f;
+
+	if( choice < specProb ) {
+		L = SampleBRDF( u, V, N );
+	} else {
+		float3 T, B;
+		orthonormalBasis( N, T, B );
+		float3 d = SampleCosineHemisphere( u );
+		L = T * d.x + B * d.y + N * d.z;
+	}
+	float cosL = dot( L, N );
+	if( cosL <= 0.0f )
+		return false;
+	float pdf = (1.0f - specProb) * cosL / M_PI + (specProb > 0.0f ? specProb * BRDFPdf( V, L, N ) : 0.0f);
+	if( pdf <= 0.0f )
+		return false;
+	weight = BRDF( V, L, N, float3( 1.0f )) * (1.0f / pdf);
+	return true;
+}
 
-	float sunDiskTan = tan( DEG2RAD(env.SunDiskAngle) * 0.5f );
+float3 ShaderPhoto::SampleSunDir( const Sampler & sampler, int index, int count ) const {
+	float2 u = sampler.Get2D( eDimensionSun, index, count );
+	float oneMinusCos = u.x * m_SunOneMinusCos;
+	float sinT = ncSqrt( oneMinusCos * (2.0f - oneMinusCos));
+	float s, c;
+	ncSinCos( 2.0f * M_PI * u.y, s, c );
+	float3 sunT, sunB;
+	orthonormalBasis( m_SunDir, sunT, sunB );
+	return normalize( sunT * (sinT * c) + sunB * (sinT * s) + m_SunDir * (1.0f - oneMinusCos));
+}
 
-	Material mtlWhite;
-	mtlWhite.Kd = float3(0.5,0.5,0.5);
+float3 ShaderPhoto::SampleSkyDir( const Sampler & sampler, int index, int count, float3 N, float3 n, float & invPdf ) {
+	float3 T, B;
+	orthonormalBasis( N, T, B );
+	float3 d = SampleCosineHemisphere( sampler.Get2D( eDimensionGI, index, count ));
+	float3 dir = T * d.x + B * d.y + N * d.z;
+	invPdf = (d.z > 0.0f && dot( dir, n ) > 0.0f) ? M_PI / d.z : 0.0f;
+	return dir;
+}
 
-	float3 Sun = env.SunColor * env.SunStrength;
-	float3 Contrib(0,0,0);
 
-	float2 UV = result.GetUV();
-	const Material & M = *result.material;
-	float3 hit = result.hit;
+void ShaderPhoto::GetLightSampleCounts( const Environment & env, bool bSpecular, int bounce, int & numSun, int & numSky, int & numLights, int & numBRDF ) const {
+	numSun = env.SunSamples;
+	numSky = env.GISamples;
+	numLights = env.pLights ? env.LightSamples : 0;
+	numBRDF = bSpecular ? env.BRDFSamples : 0;
+	if( bounce > 0 ) {
+		numSun = Min( numSun, 1 );
+		numSky = Min( numSky, 1 );
+		numLights = Min( numLights, 1 );
+		numBRDF = Min( numBRDF, 1 );
+	}
+}
 
-	float3 N = result.GetInterpolatedNormal(); //ComputeNormal( ri, M, UV );
+int ShaderPhoto::GetLightSampleCount( const Environment & env, const Material & M, int bounce ) const {
+	int numSun, numSky, numLights, numBRDF;
+	GetLightSampleCounts( env, ShadingPoint::HasSpecular( M ), bounce, numSun, numSky, numLights, numBRDF );
+	return numSun + numSky + numLights + numBRDF;
+}
 
-	for( int i=0; i<env.SunSamples; ++i ) {
-		Ray rs( hit, m_SunDir );
-		if( i ) {
-			rs.dir += randUnitSphere() * sunDiskTan;
-			rs.dir = normalize( rs.dir );
+bool ShaderPhoto::SampleLight( const Sampler & sampler, const Environment & env, const ShadingPoint & sp, float3 P, float3 V, float3 N, float3 n, int bounce, int index,
+	float3 & dir, float & dist, float3 & contrib ) const
+{
+	int numSun, numSky, numLights, numBRDF;
+	GetLightSampleCounts( env, sp.bSpecular, bounce, numSun, numSky, numLights, numBRDF );
+	contrib = float3( 0.0f );
+	dist = INFINITE_HITLEN;
+
+	if( index < numSun ) {
+		dir = SampleSunDir( sampler, index, numSun );
+		if( dot( dir, n ) <= 0.0f )
+			return false;
+		float w = numBRDF ? PowerHeuristic( numSun, m_SunPdf, numBRDF, sp.BRDFPdf( V, dir, N )) : 1.0f;
+		contrib = sp.BRDF( V, dir, N, m_SunRadiance ) * (w / (m_SunPdf * float( numSun )));
+		return true;
+	}
+	index -= numSun;
+
+	if( index < numSky ) {
+		float invPdf;
+		if( env.pSkyMap ) {
+			// drawn from the radiance of the map, the directions below the surface are lost
+			float pdf;
+			dir = env.pSkyMap->Sample( sampler.Get2D( eDimensionGI, index, numSky ), pdf );
+			if( pdf <= 0.0f || dot( dir, n ) <= 0.0f || dot( dir, N ) <= 0.0f )
+				return false;
+			invPdf = 1.0f / pdf;
+		} else {
+			dir = SampleSkyDir( sampler, index, numSky, N, n, invPdf );
+			if( invPdf == 0.0f )
+				return false;
 		}
-		IntersectResult hitTest;
-		if( !pRaytracer->TraceRay( rs, hitTest ))
-			Contrib += BRDF( V, m_SunDir, N, Sun, M, UV );
+		float w = numBRDF ? PowerHeuristic( numSky, 1.0f / invPdf, numBRDF, sp.BRDFPdf( V, dir, N )) : 1.0f;
+		contrib = sp.BRDF( V, dir, N, env.GetSkyRadiance( dir )) * (w * invPdf / float( numSky ));
+		return true;
 	}
-	for( int i=0; i<env.GISamples; ++i ) {
-		Ray rs( hit, randUnitSphere() );
-		if( dot( rs.dir, result.n ) < 0.0f )
-			rs.dir = reflect( rs.dir, result.n );
-		IntersectResult hitTest;
-		if( !pRaytracer->TraceRay( rs, hitTest ))
-			Contrib += BRDF( V, rs.dir, N, Sky, M, UV );
-		else if( (int)context < env.GIBounces ) {
+	index -= numSky;
+
+	if( index < numLights ) {
+		// an emitter picked for P, then a point uniformly over its area, the ray stops just before it
+		float pmf;
+		int light = env.pLights->Pick( sampler.Get2D( eDimensionLight, index, numLights ).x, P, N, pmf );
+		if( light < 0 )
+			return false;
+		const LightTree::Emitter & e = env.pLights->GetEmitter( light );
+		float3 d = env.pLights->SamplePoint( light, sampler.Get2D( eDimensionLightPoint, index, numLights )) - P;
+		float dist2 = dot( d, d );
+		if( dist2 <= 0.0f )
+			return false;
+		dist = ncSqrt( dist2 );
+		dir = d * (1.0f / dist);
+		float cosL = -dot( e.n, dir );
+		if( cosL <= 0.0f || dot( dir, n ) <= 0.0f || dot( dir, N ) <= 0.0f )
+			return false;
+		float pdf = pmf * dist2 / (e.area * cosL);
+		contrib = sp.BRDF( V, dir, N, e.Le ) * (1.0f / (pdf * float( numLights )));
+		dist *= 0.999f;
+		return true;
+	}
+	index -= numLights;
+
+	dir = sp.SampleBRDF( sampler.Get2D( eDimensionBRDF, index, numBRDF ), V, N );
+	float pdf = sp.BRDFPdf( V, dir, N );
+	float cosN = dot( dir, N );
+	if( pdf <= 0.0f || cosN <= 0.0f || dot( dir, n ) <= 0.0f )
+		return false;
+	float w = numSky ? PowerHeuristic( numBRDF, pdf, numSky, env.pSkyMap ? env.pSkyMap->Pdf( dir ) : cosN / M_PI ) : 1.0f;
+	float3 L = env.GetSkyRadiance( dir ) * w;
+	if( InSunCone( dir ))
+		L += m_SunRadiance * (numSun ? PowerHeuristic( numBRDF, pdf, numSun, m_SunPdf ) : 1.0f);
+	contrib = sp.BRDF( V, dir, N, L ) * (1.0f / (pdf * float( numBRDF )));
+	return true;
+}
+
+
+float3 ShaderPhoto::Shade( Ray & ray, IntersectResult & result, const Environment & env, IRaytracer * pRaytracer, ShadingContext & context ) {
+
+	if( !result.triangle )
+		return env.GetSkyRadiance( ray.dir );
+
+	// Iterative path: every vertex adds its direct light scaled by the path throughput, then the path continues
+	// through the BRDF until GIBounces or the Russian roulette ends it. The sky and the sun are only reached through
+	// the light samples, a bounce ray leaving the scene ends the path without adding them a second time.
+	PathState & path = context.path;
+	Sampler & sampler = context.sampler;
+	const IScene * pScene = pRaytracer->GetScene();
+
+	float3 Contrib(0,0,0);
+	float3 V = -ray.dir;
+	IntersectResult * pHit = &result;
+	IntersectResult bounceHit;
+
+	for( ;; ) {
+		IntersectResult & hit = *pHit;
+		pScene->InterpolateTriangleAttributes( hit, ShadingPoint::GetAttributes( *hit.material ));
+
+		ShadingPoint sp;
+		sp.Init( *hit.material, hit.GetUV() );
+		sampler.SetBounce( path.bounce );
+
+		// the normal and bump maps shade the vertex, the cached indirect light is looked up with the smooth normal
+		const float3 N = sp.GetNormal( *hit.material, hit );
+		const float3 Ns = hit.GetInterpolatedNormal();
+
+		int numSun, numSky, numLights, numBRDF;
+		GetLightSampleCounts( env, sp.bSpecular, path.bounce, numSun, numSky, numLights, numBRDF );
+
+		// the emitters are only reached through their samples, except by the camera that sees them directly
+		float3 Direct(0,0,0);
+		if( path.bounce == 0 && dot( hit.n, V ) > 0.0f )
+			Direct = hit.material->Ke;
+		for( int i=0, count=numSun+numSky+numLights+numBRDF; i<count; ++i ) {
+			float3 dir, LightContrib;
+			float dist;
+			if( !SampleLight( sampler, env, sp, hit.hit, V, N, hit.n, path.bounce, i, dir, dist, LightContrib ))
+				continue;
+			Ray rs( hit.hit, dir, i < numSun ? Ray::eShadow : Ray::eGI );
+			rs.hitlen = dist;
+			IntersectResult hitTest;
+			if( !pRaytracer->TraceRay( rs, hitTest ))
+				Direct += LightContrib;
+		}
+		Contrib += path.throughput * Direct;
+
+		if( path.bounce >= env.GIBounces )
+			break;
 
+		// past the camera hit, the photon map stands for the rest of the path
+		const PhotonMap * pPhotons = path.bounce > 0 ? pRaytracer->GetPhotonMap() : NULL;
+		if( pPhotons ) {
+			Contrib += path.throughput * sp.albedo * pPhotons->GetIrradiance( hit.hit, Ns, env.GIBounces - path.bounce ) * (1.0f / M_PI);
+			break;
+		}
 
+		// the diffuse indirect light of the camera hits comes from the irradiance cache, instead of continuing the path
+		IrradianceCache * pCache = path.bounce == 0 ? pRaytracer->GetIrradianceCache() : NULL;
+		if( pCache ) {
+			float3 E;
+			if( !pCache->Lookup( hit.hit, Ns, E ))
+				E = GatherIrradiance( *pCache, hit, Ns, env, pRaytracer, context );
+			Contrib += path.throughput * sp.albedo * E * (1.0f / M_PI);
+			break;
+		}
 
-			// trace further here....
+		float2 u = sampler.Get2D( eDimensionBounce, 0, 1 ), r = sampler.Get2D( eDimensionPath, 0, 1 );
+		float3 L, weight;
+		if( !sp.SampleBounce( u, r.x, V, N, L, weight ) || dot( L, hit.n ) <= 0.0f )
+			break;
+		path.throughput = path.throughput * weight;
+
+		// the paths carrying little light are ended early, the survivors carry their share
+		if( path.bounce+1 >= RR_MIN_BOUNCES ) {
+			float q = Min( Max( path.throughput.x, Max( path.throughput.y, path.throughput.z )), 0.95f );
+			if( r.y >= q )
+				break;
+			path.throughput *= 1.0f / q;
 		}
+
+		Ray rb( hit.hit, L, Ray::eGI );
+		bounceHit = IntersectResult();
+		if( !pRaytracer->TraceRay( rb, bounceHit ))
+			break;
+		V = -L;
+		pHit = &bounceHit;
+		path.bounce++;
 	}
-	Contrib *= 1.0f / float( env.SunSamples + env.GISamples );
 	return Contrib;
-
 }
 
+float3 ShaderPhoto::GatherIrradiance( IrradianceCache & cache, const IntersectResult & hit, float3 N, const Environment & env, IRaytracer * pRaytracer,
+	ShadingContext & context ) {
+
+	int numTheta, numPhi;
+	IrradianceCache::GetStrata( cache.GetSampleCount(), numTheta, numPhi );
+	float3 * L = context.arena.Alloc<float3>( numTheta*numPhi );
+	float  * dist = context.arena.Alloc<float>( numTheta*numPhi );
+
+	float3 t, b;
+	orthonormalBasis( N, t, b );
+
+	// every gather ray continues as a path of its own, from the first bounce on
+	Sampler sampler = context.sampler;
+	const PathState path = context.path;
+	NanoCore::Random random = sampler.GetRandom();
+	for( int j=0; j<numTheta; ++j )
+		for( int k=0; k<numPhi; ++k ) {
+			float3 & Li = L[j*numPhi + k];
+			Li = float3( 0.0f );
+			dist[j*numPhi + k] = INFINITE_HITLEN;
+
+			float2 u( random.NextFloat(), random.NextFloat() );
+			Ray ray( hit.hit, IrradianceCache::GetSampleDir( N, t, b, j, k, numTheta, numPhi, u ), Ray::eGI );
+			if( dot( ray.dir, hit.n ) <= 0.0f )
+				continue;
+			IntersectResult gatherHit;
+			if( !pRaytracer->TraceRay( ray, gatherHit ))
+				continue;
+			// the scene traces a copy of the ray, its hitlen is not the distance of the hit
+			dist[j*numPhi + k] = len( gatherHit.hit - hit.hit );
+
+			context.sampler = sampler;
+			context.sampler.Fork( uint32( j*numPhi + k ));
+			context.path.Reset();
+			context.path.bounce = 1;
+			Li = Shade( ray, gatherHit, env, pRaytracer, context );
+		}
+	context.sampler = sampler;
+	context.path = path;
+
+	return cache.AddRecord( hit.hit, N, L, dist, numTheta, numPhi );
+}
@@ -1,11 +1,87 @@
+#ifndef ___INC_RAYTRACER_SHADERPHOTO
+#define ___INC_RAYTRACER_SHADERPHOTO
+
 #include "Common.h"
 
+class Sampler;
+class IrradianceCache;
+
+
+
+struct ShadingKernel;
+
+// Material of a hit with its textures looked up once, the light samples of the hit then only evaluate the
+// closed-form Blinn-Phong lobe. The lookups and the lobe are done by the kernel specialized for Material::features,
+// so neither tests the features of the material per sample.
+struct ShadingPoint {
+	float3 albedo;     // diffuse map times Kd
+	float3 specular;   // specular map, or the albedo without one
+	float  power;      // exponent of the specular lobe
+	float  specNorm;   // energy normalization of the lobe
+	bool   bSpecular;
+	const ShadingKernel * kernel;
+
+	void   Init( const Material & M, float2 uv );  // adds its texture fetches to the RayStats of the thread
+	float3 BRDF( float3 V, float3 L, float3 N, float3 LightColor ) const;  // times the cosine term
+	// interpolated normal of the hit perturbed by the normal or bump map of M, after Init
+	float3 GetNormal( const Material & M, const IntersectResult & hit ) const;
+	static int GetAttributes( const Material & M );  // IntersectResult flags needed by Init and GetNormal
+
+	// importance sampling of the specular lobe, through its half vector
+	float3 SampleBRDF( float2 u, float3 V, float3 N ) const;
+	float  BRDFPdf( float3 V, float3 L, float3 N ) const;  // solid angle density of SampleBRDF
+	// continuation of a path through the diffuse or the specular lobe, weight is BRDF * cosine / pdf
+	bool   SampleBounce( float2 u, float choice, float3 V, float3 N, float3 & L, float3 & weight ) const;
+
+	static bool HasSpecular( const Material & M ) { return (M.features & Material::eFeatureSpecular) != 0; }
+};
+
+
+
 class ShaderPhoto : public IShader {
 public:
+	enum ESampleDimension {
+		eDimensionSun,
+		eDimensionGI,
+		eDimensionBRDF,
+		eDimensionBounce,  // direction of the next bounce
+		eDimensionPath,    // lobe choice and Russian roulette
+		eDimensionLight,       // emitter picked by the light tree
+		eDimensionLightPoint,  // point on the emitter
+	};
+
 	virtual void   BeginShading( const Environment & env );
-	virtual float3 Shade( Ray & V, IntersectResult & result, const Environment & env, IRaytracer * pRaytracer, void * context );
-	virtual void*  CreateContext() { return NULL; }
+	virtual float3 Shade( Ray & V, IntersectResult & result, const Environment & env, IRaytracer * pRaytracer, ShadingContext & context );
+
+	// Direct light of a path vertex, shared with the wavefront renderer so that both produce the same camera hits.
+	// The samples of a vertex are the sun cone samples, the sky samples (cosine-weighted, or drawn from the radiance
+	// of the sky map), the emissive triangle samples, then the specular lobe samples of glossy materials. The sun and the sky are each estimated from
+	// their own samples and the lobe samples, combined with the power heuristic, so the highlights no longer depend on the light samples alone.
+	// Vertices after the camera hit take one sample of each kind, which bounds the cost of a path.
+	void GetLightSampleCounts( const Environment & env, bool bSpecular, int bounce, int & numSun, int & numSky, int & numLights, int & numBRDF ) const;
+	int  GetLightSampleCount( const Environment & env, const Material & M, int bounce ) const;
+	// contrib is the weighted radiance brought by the sample when dir is not occluded up to dist, 0 when it needs no ray
+	bool SampleLight( const Sampler & sampler, const Environment & env, const ShadingPoint & sp, float3 P, float3 V, float3 N, float3 n, int bounce, int index,
+		float3 & dir, float & dist, float3 & contrib ) const;
+
+	float3 GetSunDir() const { return m_SunDir; }
+	float3 SampleSunDir( const Sampler & sampler, int index, int count ) const;  // uniform over the sun cone
+	// cosine-weighted around the shading normal N, invPdf is 0 for the directions below the geometric normal n
+	static float3 SampleSkyDir( const Sampler & sampler, int index, int count, float3 N, float3 n, float & invPdf );
+
+	static const int RR_MIN_BOUNCES = 2;  // Russian roulette starts after this many bounces
 
 private:
+	// new irradiance record at a camera hit, from the radiance of the paths leaving it over a stratified hemisphere
+	float3 GatherIrradiance( IrradianceCache & cache, const IntersectResult & hit, float3 N, const Environment & env, IRaytracer * pRaytracer,
+		ShadingContext & context );
+
+	bool InSunCone( float3 dir ) const { return 1.0f - dot( dir, m_SunDir ) <= m_SunOneMinusCos; }
+
 	float3 m_SunDir;
-};
\ No newline at end of file
+	float3 m_SunRadiance;     // radiance of the sun disk, its irradiance at normal incidence is SunColor * SunStrength
+	float  m_SunOneMinusCos;  // 1 - cosine of the cone half angle
+	float  m_SunPdf;          // 1 / solid angle of the cone
+};
+
+#endif
@@ -4,13 +4,10 @@ ShaderPreview::ShaderPreview() : m_Shader( ShaderPreview::eColoredCube ) {
 }
 
 void ShaderPreview::BeginShading( const Environment & env ) {
-	matrix m1, m2;
-	m1.setRotationAxis( float3(1,0,0), DEG2RAD(env.SunAngle1) );
-	m2.setRotationAxis( float3(0,0,1), DEG2RAD(env.SunAngle2) );
-	m_SunDir = m2 * m1 * float3(0,0,-1);
+	m_SunDir = env.GetSunDir();
 }
 
-float3 ShaderPreview::Shade( Ray & V, IntersectResult & result, const Environment & env, IRaytracer * pRaytracer, void * context ) {
+float3 ShaderPreview::Shade( Ray & V, IntersectResult & result, const Environment & env, IRaytracer * pRaytracer, ShadingContext & context ) {
 
 	if( result.triangle == NULL )
 		return 0.0f;
@@ -18,7 +15,7 @@ float3 ShaderPreview::Shade( Ray & V, IntersectResult & result, const Environmen
 	float shade = 1.0f;
 	switch( m_Shader ) {
 		case eColoredCubeShadowed: {
-			Ray ray( result.hit, m_SunDir );
+			Ray ray( result.hit, m_SunDir, Ray::eShadow );
 			IntersectResult rSun;
 			if( pRaytracer->TraceRay( ray, rSun ))
 				shade = 0.2f;
@@ -22,8 +22,7 @@ public:
 	ShaderPreview();
 
 	virtual void   BeginShading( const Environment & env );
-	virtual float3 Shade( Ray & V, IntersectResult & hit, const Environment & env, IRaytracer * pRaytracer, void * context );
-	virtual void*  CreateContext() { return NULL; }
+	virtual float3 Shade( Ray & V, IntersectResult & hit, const Environment & env, IRaytracer * pRaytracer, ShadingContext & context );
 
 private:
 	float3 m_SunDir;
@@ -0,0 +1,26 @@
+#ifndef ___INC_RAYTRACE_SHADINGCONTEXT
+#define ___INC_RAYTRACE_SHADINGCONTEXT
+
+#include <NanoCore/Memory.h>
+#include "Common.h"
+#include "Sampler.h"
+
+
+
+// Path being traced by the thread, reset for each camera ray.
+struct PathState {
+	float3 throughput;  // product of the bounce weights, scales the light found at the current vertex
+	int    bounce;      // 0 at the camera hit
+
+	PathState() { Reset(); }
+	void Reset() { throughput = float3( 1.0f ); bounce = 0; }
+};
+
+// Created once per render thread and passed down through RenderRay/Shade.
+struct ShadingContext {
+	Sampler sampler;
+	NanoCore::MemoryArena arena;  // scratch memory, reset before each job
+	PathState path;
+};
+
+#endif
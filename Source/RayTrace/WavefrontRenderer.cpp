@@ -0,0 +1,412 @@
+#include <NanoCore/Threads.h>
+#include "WavefrontRenderer.h"
+#include "RayTracer.h"
+#include "ShaderPhoto.h"
+
+
+
+static const int WAVE_SIZE = 1 << 14;     // paths in flight
+static const int PATH_CHUNK_SIZE = 1024;  // paths per chunk job
+static const int RAY_CHUNK_SIZE = 4096;   // shadow rays per chunk job
+
+static const char * STAGE_NAMES[WavefrontRenderer::eStageCount] = { "generate", "extend", "sort hits", "shade", "sort rays", "shadow", "accumulate" };
+
+
+
+// spreads the low 9 bits of v to every third bit
+static uint32 SpreadBits( uint32 v ) {
+	v &= 0x1FF;
+	v = (v | (v << 16)) & 0x030000FF;
+	v = (v | (v <<  8)) & 0x0300F00F;
+	v = (v | (v <<  4)) & 0x030C30C3;
+	v = (v | (v <<  2)) & 0x09249249;
+	return v;
+}
+
+// direction octant in the top bits, so each octant is traced separately, then the Morton code of the origin
+static uint32 RaySortKey( const float3 & origin, const float3 & dir, const AABB & box, const float3 & scale ) {
+	uint32 octant = (dir.x < 0.0f ? 1 : 0) | (dir.y < 0.0f ? 2 : 0) | (dir.z < 0.0f ? 4 : 0);
+	uint32 x = uint32( Clamp( (origin.x - box.min.x) * scale.x, 0.0f, 511.0f ));
+	uint32 y = uint32( Clamp( (origin.y - box.min.y) * scale.y, 0.0f, 511.0f ));
+	uint32 z = uint32( Clamp( (origin.z - box.min.z) * scale.z, 0.0f, 511.0f ));
+	return (octant << 27) | (SpreadBits( x ) << 2) | (SpreadBits( y ) << 1) | SpreadBits( z );
+}
+
+// material in the top bits, then the Morton code of the UV inside the unit square, as textures wrap
+static uint32 HitSortKey( const IntersectResult & result ) {
+	if( !result.material )
+		return 0xFFFFFFFF;  // misses go last
+	float2 uv = result.GetUV();
+	uint32 u = uint32( ncFrac( uv.x ) * 255.0f ) & 0xFF;
+	uint32 v = uint32( ncFrac( uv.y ) * 255.0f ) & 0xFF;
+	uint32 morton = 0;
+	for( int b=0; b<8; ++b )
+		morton |= (((u >> b) & 1) << (2*b)) | (((v >> b) & 1) << (2*b + 1));
+	return (uint32( result.materialId & 0xFFFF ) << 16) | morton;
+}
+
+// LSD radix sort of key << 32 | index pairs by their key, 8 bits per pass, the result ends up back in 'data'
+static void RadixSort( uint64 * data, uint64 * temp, int count ) {
+	uint64 * src = data;
+	uint64 * dst = temp;
+	for( int shift=32; shift<64; shift+=8 ) {
+		int offsets[256] = { 0 };
+		for( int i=0; i<count; ++i )
+			offsets[(src[i] >> shift) & 0xFF]++;
+		for( int b=0, sum=0; b<256; ++b ) {
+			int n = offsets[b];
+			offsets[b] = sum;
+			sum += n;
+		}
+		for( int i=0; i<count; ++i )
+			dst[offsets[(src[i] >> shift) & 0xFF]++] = src[i];
+		uint64 * t = src; src = dst; dst = t;
+	}
+}
+
+
+
+class WavefrontRenderer::KernelJob : public NanoCore::IJob {
+public:
+	KernelJob( WavefrontRenderer * pRenderer ) : IJob( Raytracer::eJobKernel ), pRenderer(pRenderer), stage(eGenerate), begin(0), end(0) {}
+
+	virtual void Execute() { pRenderer->RunKernel( stage, begin, end ); }
+	virtual const wchar_t * GetName() { return L"WavefrontKernel"; }
+
+	WavefrontRenderer * pRenderer;
+	EStage stage;
+	int begin, end;
+};
+
+class WavefrontRenderer::StageJob : public NanoCore::IJob {
+public:
+	StageJob( WavefrontRenderer * pRenderer ) : IJob( Raytracer::eJobStage ), pRenderer(pRenderer) {}
+
+	virtual void Execute() { pRenderer->DispatchNextStage(); }
+	virtual const wchar_t * GetName() { return L"WavefrontStage"; }
+
+	WavefrontRenderer * pRenderer;
+};
+
+
+
+void WavefrontRenderer::PathQueue::Resize( int size ) {
+	pixel.resize( size );
+	dirX.resize( size );
+	dirY.resize( size );
+	dirZ.resize( size );
+	hits.resize( size );
+	radiance.resize( size );
+	shadowFirst.resize( size );
+	shadowCount.resize( size );
+	key.resize( size );
+	sorted.resize( size );
+	temp.resize( size );
+}
+
+void WavefrontRenderer::ShadowQueue::Reserve( int size ) {
+	if( int(path.size()) >= size )
+		return;
+	path.resize( size );
+	dirX.resize( size );
+	dirY.resize( size );
+	dirZ.resize( size );
+	hitlen.resize( size );
+	contrib.resize( size );
+	visible.resize( size );
+	key.resize( size );
+	sorted.resize( size );
+	temp.resize( size );
+}
+
+
+
+WavefrontRenderer::WavefrontRenderer() : m_pRaytracer(NULL), m_pShader(NULL), m_pCallback(NULL), m_Priority(NanoCore::IJob::ePriorityNormal),
+	m_WaveStart(0), m_WaveSize(0), m_NextStage(eGenerate), m_StageStartTicks(0), m_bSortHits(false), m_bSortRays(false), m_ShadowRays(0), m_ShadowNodes(0), m_ShadowNodesStart(0)
+{
+	m_Shadows.count = 0;
+	for( int i=0; i<eStageCount; ++i )
+		m_StageTicks[i] = 0;
+	m_pStageJob = new StageJob( this );
+}
+
+WavefrontRenderer::~WavefrontRenderer() {
+	for( size_t i=0; i<m_KernelJobs.size(); ++i )
+		delete m_KernelJobs[i];
+	delete m_pStageJob;
+}
+
+void WavefrontRenderer::Start( Raytracer * pRaytracer, ShaderPhoto * pShader, IStatusCallback * pCallback, NanoCore::IJob::EPriority priority ) {
+	m_pRaytracer = pRaytracer;
+	m_pShader = pShader;
+	m_pCallback = pCallback;
+	m_Priority = priority;
+	m_bSortHits = pRaytracer->m_SortHits != 0;
+	m_bSortRays = pRaytracer->m_SortRays != 0;
+
+	m_Paths.Resize( WAVE_SIZE );
+	m_WaveStart = 0;
+	m_WaveSize = 0;
+	m_NextStage = eGenerate;
+	m_StageStartTicks = 0;
+	for( int i=0; i<eStageCount; ++i )
+		m_StageTicks[i] = 0;
+	m_ShadowRays = m_ShadowNodes = 0;
+
+	m_pStageJob->SetType( pRaytracer->GetJobType( Raytracer::eJobStage ));
+	m_pStageJob->SetPriority( priority );
+	NanoCore::JobManager::AddJob( m_pStageJob );
+}
+
+void WavefrontRenderer::PrintStats() const {
+	uint64 total = 0;
+	for( int i=0; i<eStageCount; ++i )
+		total += m_StageTicks[i];
+	NanoCore::DebugOutput( "  wavefront stages:" );
+	for( int i=0; i<eStageCount; ++i )
+		NanoCore::DebugOutput( " %s %0.1f ms (%d%%)", STAGE_NAMES[i], float( NanoCore::TickToMicroseconds( m_StageTicks[i] )) * 0.001f,
+			total ? int( m_StageTicks[i] * 100 / total ) : 0 );
+	NanoCore::DebugOutput( "\n" );
+	NanoCore::DebugOutput( "  shadow stage: %lld rays, %0.1f nodes/ray, %0.1f ms, %s\n", m_ShadowRays, float( m_ShadowNodes ) / float( Max( m_ShadowRays, int64(1) )),
+		float( NanoCore::TickToMicroseconds( m_StageTicks[eShadow] )) * 0.001f, m_bSortRays ? "sorted" : "unsorted" );
+	NanoCore::DebugOutput( "  shade stage: %0.1f ms, %s\n", float( NanoCore::TickToMicroseconds( m_StageTicks[eShade] )) * 0.001f,
+		m_bSortHits ? "sorted by material" : "unsorted" );
+}
+
+bool WavefrontRenderer::BeginWave() {
+	Raytracer * pRT = m_pRaytracer;
+	const int numPixels = pRT->m_pImage->GetWidth() * pRT->m_pImage->GetHeight();
+
+	m_WaveStart += m_WaveSize;
+	if( m_WaveSize ) {
+		pRT->m_FrameVersion++;
+		if( m_pCallback )
+			m_pCallback->SetStatus( "Rendering (wavefront): pass %d, %d %%, %0.2f spp, %0.2f s, %0.2f Mrays/s", pRT->m_Pass+1, int( int64(m_WaveStart) * 100 / numPixels ), pRT->GetSamplesPerPixel(),
+				pRT->GetRenderSeconds(), pRT->GetRaysPerSecond() * 0.000001f );
+	}
+
+	if( m_WaveStart >= numPixels ) {
+		// the budget is checked between passes only, so every pixel of the image has the same number of samples
+		const bool bLastPass = pRT->m_MaxPasses && pRT->m_Pass+1 >= pRT->m_MaxPasses;
+		if( bLastPass || pRT->IsOverBudget() ) {
+			pRT->EndRender( pRT->m_Pass+1 );
+			return false;
+		}
+		pRT->m_Pass++;
+		m_WaveStart = 0;
+	}
+
+	const Environment & env = pRT->GetEnvironment();
+	m_WaveSize = Min( WAVE_SIZE, numPixels - m_WaveStart );
+	m_Shadows.Reserve( m_WaveSize * (env.SunSamples + env.GISamples + (env.pLights ? env.LightSamples : 0) + env.BRDFSamples) );
+	m_Shadows.count = 0;
+	return true;
+}
+
+void WavefrontRenderer::DispatchNextStage() {
+	const uint64 now = NanoCore::GetTicks();
+	if( m_StageStartTicks )
+		m_StageTicks[(m_NextStage + eStageCount - 1) % eStageCount] += now - m_StageStartTicks;
+	m_StageStartTicks = now;
+
+	// the stages of a rendering never overlap and the instance counts its own rays, so the difference of its totals is
+	// the traversal work of the shadow stage alone
+	if( m_NextStage == eShadow || m_NextStage == eAccumulate ) {
+		RayStats stats;
+		m_pRaytracer->GetRenderStats( stats );
+		if( m_NextStage == eShadow )
+			m_ShadowNodesStart = stats.Get( RayStats::eNodesVisited );
+		else
+			m_ShadowNodes += stats.Get( RayStats::eNodesVisited ) - m_ShadowNodesStart;
+	}
+
+	if( m_NextStage == eGenerate && !BeginWave() ) {
+		m_StageStartTicks = 0;
+		float ms = m_pRaytracer->GetRenderSeconds() * 1000.0f;
+		NanoCore::DebugOutput( "Rendering finished for %0.3f ms (wavefront), %0.2f samples per pixel\n", ms, m_pRaytracer->GetSamplesPerPixel() );
+		m_pRaytracer->PrintStats();
+		PrintStats();
+		m_pRaytracer->PrintNodeStats( ms * 0.001f );
+		return;
+	}
+
+	const EStage stage = m_NextStage;
+	int count = m_WaveSize, chunk = PATH_CHUNK_SIZE;
+	if( stage == eShadow ) {
+		count = m_Shadows.count;
+		chunk = RAY_CHUNK_SIZE;
+		m_ShadowRays += count;
+	} else if( stage == eSortHits || stage == eSortRays ) {
+		// a single job, the radix sort is cheap next to the tracing and the shading
+		count = (stage == eSortHits ? m_bSortHits : (m_bSortRays && m_Shadows.count)) ? 1 : 0;
+		chunk = 1;
+	}
+	const int numJobs = (count + chunk - 1) / chunk;
+
+	while( int(m_KernelJobs.size()) < numJobs )
+		m_KernelJobs.push_back( new KernelJob( this ));
+
+	for( int i=0; i<numJobs; ++i ) {
+		KernelJob * pJob = m_KernelJobs[i];
+		pJob->stage = stage;
+		pJob->begin = i * chunk;
+		pJob->end = Min( pJob->begin + chunk, count );
+		pJob->SetType( m_pRaytracer->GetJobType( Raytracer::eJobKernel ));
+		pJob->SetPriority( m_Priority );
+		NanoCore::JobManager::AddJob( pJob );
+	}
+
+	m_NextStage = EStage( (stage + 1) % eStageCount );
+	NanoCore::JobManager::AddJob( m_pStageJob, m_pRaytracer->GetJobType( Raytracer::eJobKernel ));
+}
+
+void WavefrontRenderer::RunKernel( EStage stage, int begin, int end ) {
+	switch( stage ) {
+		case eGenerate:   Generate( begin, end ); break;
+		case eExtend:     Extend( begin, end ); break;
+		case eShade:      Shade( begin, end ); break;
+		case eSortHits:   SortHits(); break;
+		case eSortRays:   SortRays(); break;
+		case eShadow:     Shadow( begin, end ); break;
+		case eAccumulate: Accumulate( begin, end ); break;
+		default: break;
+	}
+}
+
+void WavefrontRenderer::Generate( int begin, int end ) {
+	const Camera & camera = m_pRaytracer->m_Camera;
+	const int w = m_pRaytracer->m_pImage->GetWidth(), h = m_pRaytracer->m_pImage->GetHeight();
+	for( int i=begin; i<end; ++i ) {
+		int pixel = m_WaveStart + i;
+		float3 dir = camera.ConstructRay( pixel % w, pixel / w, w, h );
+		m_Paths.pixel[i] = pixel;
+		m_Paths.dirX[i] = dir.x;
+		m_Paths.dirY[i] = dir.y;
+		m_Paths.dirZ[i] = dir.z;
+	}
+}
+
+void WavefrontRenderer::Extend( int begin, int end ) {
+	const float3 origin = m_pRaytracer->m_Camera.pos;
+	const IScene * pScene = m_pRaytracer->GetScene();
+	for( int i=begin; i<end; ++i ) {
+		Ray ray( origin, float3( m_Paths.dirX[i], m_Paths.dirY[i], m_Paths.dirZ[i] ));
+		IntersectResult & result = m_Paths.hits[i];
+		result = IntersectResult();
+		m_pRaytracer->TraceRay( ray, result );
+		if( m_bSortHits ) {
+			if( result.material )
+				pScene->InterpolateTriangleAttributes( result, IntersectResult::eUV );
+			m_Paths.key[i] = HitSortKey( result );
+		}
+	}
+}
+
+void WavefrontRenderer::Shade( int begin, int end ) {
+	const Environment & env = m_pRaytracer->GetEnvironment();
+	const int w = m_pRaytracer->m_pImage->GetWidth();
+
+	// one reservation per chunk keeps the rays of a path contiguous in the queue
+	int numRays = 0;
+	for( int j=begin; j<end; ++j ) {
+		const IntersectResult & result = m_Paths.hits[m_bSortHits ? int( uint32( m_Paths.sorted[j] )) : j];
+		if( result.material )
+			numRays += m_pShader->GetLightSampleCount( env, *result.material, 0 );
+	}
+	int next = NanoCore::AtomicAdd( &m_Shadows.count, numRays );
+
+	ShadingContext & context = m_pRaytracer->GetThreadContext();
+	const IScene * pScene = m_pRaytracer->GetScene();
+	const PhotonMap * pPhotons = m_pRaytracer->GetPhotonMap();
+
+	const AABB box = pScene->GetAABB();
+	const float3 extent = box.max - box.min;
+	const float3 scale( 512.0f / Max( extent.x, 1e-6f ), 512.0f / Max( extent.y, 1e-6f ), 512.0f / Max( extent.z, 1e-6f ));
+
+	for( int j=begin; j<end; ++j ) {
+		int i = m_bSortHits ? int( uint32( m_Paths.sorted[j] )) : j;
+		IntersectResult & result = m_Paths.hits[i];
+		if( !result.material ) {
+			m_Paths.radiance[i] = env.GetSkyRadiance( float3( m_Paths.dirX[i], m_Paths.dirY[i], m_Paths.dirZ[i] ));
+			m_Paths.shadowFirst[i] = 0;
+			m_Paths.shadowCount[i] = 0;
+			continue;
+		}
+
+		pScene->InterpolateTriangleAttributes( result, ShadingPoint::GetAttributes( *result.material ));
+		context.sampler.Begin( m_Paths.pixel[i] % w, m_Paths.pixel[i] / w, m_pRaytracer->m_Pass );
+
+		const float3 V = -float3( m_Paths.dirX[i], m_Paths.dirY[i], m_Paths.dirZ[i] );
+		ShadingPoint sp;
+		sp.Init( *result.material, result.GetUV() );
+		const float3 N = sp.GetNormal( *result.material, result );
+
+		const int count = m_pShader->GetLightSampleCount( env, *result.material, 0 );
+		m_Paths.radiance[i] = float3( 0.0f );
+		// no final gather in the wavefront, the indirect light of the camera hit is read from the photon map directly
+		if( pPhotons )
+			m_Paths.radiance[i] = sp.albedo * pPhotons->GetIrradiance( result.hit, result.GetInterpolatedNormal(), env.GIBounces ) * (1.0f / M_PI);
+		if( dot( result.n, V ) > 0.0f )
+			m_Paths.radiance[i] += result.material->Ke;
+		m_Paths.shadowFirst[i] = next;
+		m_Paths.shadowCount[i] = count;
+
+		for( int k=0; k<count; ++k, ++next ) {
+			float3 dir, contrib;
+			float dist;
+			if( !m_pShader->SampleLight( context.sampler, env, sp, result.hit, V, N, result.n, 0, k, dir, dist, contrib ))
+				dir = N;  // zero contribution, skipped by the shadow stage
+			m_Shadows.path[next] = i;
+			m_Shadows.dirX[next] = dir.x;
+			m_Shadows.dirY[next] = dir.y;
+			m_Shadows.dirZ[next] = dir.z;
+			m_Shadows.hitlen[next] = dist;
+			m_Shadows.contrib[next] = contrib;
+			if( m_bSortRays )
+				m_Shadows.key[next] = RaySortKey( result.hit, dir, box, scale );
+		}
+	}
+}
+
+void WavefrontRenderer::SortHits() {
+	for( int i=0; i<m_WaveSize; ++i )
+		m_Paths.sorted[i] = (uint64( m_Paths.key[i] ) << 32) | uint32(i);
+	RadixSort( &m_Paths.sorted[0], &m_Paths.temp[0], m_WaveSize );
+}
+
+void WavefrontRenderer::SortRays() {
+	const int count = m_Shadows.count;
+	for( int i=0; i<count; ++i )
+		m_Shadows.sorted[i] = (uint64( m_Shadows.key[i] ) << 32) | uint32(i);
+	RadixSort( &m_Shadows.sorted[0], &m_Shadows.temp[0], count );
+}
+
+void WavefrontRenderer::Shadow( int begin, int end ) {
+	const Environment & env = m_pRaytracer->GetEnvironment();
+	for( int j=begin; j<end; ++j ) {
+		int i = m_bSortRays ? int( uint32( m_Shadows.sorted[j] )) : j;
+		const float3 & contrib = m_Shadows.contrib[i];
+		if( contrib.x == 0.0f && contrib.y == 0.0f && contrib.z == 0.0f ) {
+			m_Shadows.visible[i] = 0;
+			continue;
+		}
+		int path = m_Shadows.path[i];
+		int k = i - m_Paths.shadowFirst[path];
+		Ray ray( m_Paths.hits[path].hit, float3( m_Shadows.dirX[i], m_Shadows.dirY[i], m_Shadows.dirZ[i] ), k < env.SunSamples ? Ray::eShadow : Ray::eGI );
+		ray.hitlen = m_Shadows.hitlen[i];
+		IntersectResult result;
+		m_Shadows.visible[i] = !m_pRaytracer->TraceRay( ray, result );
+	}
+}
+
+void WavefrontRenderer::Accumulate( int begin, int end ) {
+	const int w = m_pRaytracer->m_pImage->GetWidth();
+	for( int i=begin; i<end; ++i ) {
+		float3 color = m_Paths.radiance[i];
+		for( int k=m_Paths.shadowFirst[i], last=k+m_Paths.shadowCount[i]; k<last; ++k )
+			if( m_Shadows.visible[k] )
+				color += m_Shadows.contrib[k];
+		m_pRaytracer->m_FrameBuffer.AddSample( m_Paths.pixel[i] % w, m_Paths.pixel[i] / w, color );
+	}
+	RayStats::GetThreadStats().Add( RayStats::ePixels, end - begin );
+}
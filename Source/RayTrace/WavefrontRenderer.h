@@ -0,0 +1,111 @@
+#ifndef ___INC_RAYTRACE_WAVEFRONTRENDERER
+#define ___INC_RAYTRACE_WAVEFRONTRENDERER
+
+#include <NanoCore/Jobs.h>
+#include "Common.h"
+
+#include <vector>
+
+class Raytracer;
+class ShaderPhoto;
+
+
+
+/*
+	Breadth-first alternative to the per pixel RenderRay recursion. The image is processed in waves of paths,
+	each wave goes through the stages below, and every stage runs as parallel chunk jobs over its queue:
+	  generate   - primary ray directions for the pixels of the wave
+	  extend     - closest hits of the primary rays and their UVs
+	  sort hits  - optional, orders the hits by material and UV region, so the shading of consecutive hits
+	               touches the same textures
+	  shade      - BRDF of the hits, appends the shadow and sky visibility rays with their contributions
+	  sort rays  - optional, orders the appended rays by direction octant and origin Morton code, so rays sharing
+	               the same subtrees are traced together
+	  shadow     - visibility of the appended rays
+	  accumulate - sums the visible contributions of each path into the frame buffer
+	Rays are kept as structures of arrays, so a stage streams through memory and can be vectorized across rays.
+	Only the direct light of the camera hits is traced, the GI bounces are traced by ShaderPhoto::Shade alone. With a
+	photon map, its irradiance at the camera hits stands for their diffuse indirect light: ShaderPhoto::Shade reads it
+	one bounce later, after a final gather, and also traces the specular and glossy indirect light, which are missing here.
+*/
+class WavefrontRenderer {
+public:
+	enum EStage {
+		eGenerate,
+		eExtend,
+		eSortHits,
+		eShade,
+		eSortRays,
+		eShadow,
+		eAccumulate,
+		eStageCount
+	};
+
+	WavefrontRenderer();
+	~WavefrontRenderer();
+
+	void Start( Raytracer * pRaytracer, ShaderPhoto * pShader, IStatusCallback * pCallback, NanoCore::IJob::EPriority priority );
+	void PrintStats() const;
+
+	void RunKernel( EStage stage, int begin, int end );  // called by the chunk jobs
+	void DispatchNextStage();                             // called by the stage job once the previous stage is over
+
+private:
+	struct PathQueue {
+		std::vector<int>   pixel;               // x + y*width
+		std::vector<float> dirX, dirY, dirZ;    // primary rays, all start at the camera
+		std::vector<IntersectResult> hits;
+		std::vector<float3> radiance;           // sky radiance reaching the camera directly, or the emission and photon map estimate of the hit
+		std::vector<int>   shadowFirst, shadowCount;
+		std::vector<uint32> key;                // material and UV region, filled when sorting
+		std::vector<uint64> sorted, temp;       // key << 32 | path, the path order of the shade stage
+
+		void Resize( int size );
+	};
+
+	struct ShadowQueue {
+		std::vector<int>    path;               // rays start at the hit of their path
+		std::vector<float>  dirX, dirY, dirZ;
+		std::vector<float>  hitlen;             // the rays towards an emitter stop before it
+		std::vector<float3> contrib;            // added to the path when the ray is not occluded
+		std::vector<uint8>  visible;
+		std::vector<uint32> key;                // octant and Morton code, filled when sorting
+		std::vector<uint64> sorted, temp;       // key << 32 | ray, the ray order of the shadow stage
+		volatile int32 count;
+
+		void Reserve( int size );
+	};
+
+	class KernelJob;
+	class StageJob;
+
+	bool BeginWave();  // false when the rendering is over
+	void Generate( int begin, int end );
+	void Extend( int begin, int end );
+	void Shade( int begin, int end );
+	void SortHits();
+	void SortRays();
+	void Shadow( int begin, int end );
+	void Accumulate( int begin, int end );
+
+	Raytracer * m_pRaytracer;
+	ShaderPhoto * m_pShader;
+	IStatusCallback * m_pCallback;
+	NanoCore::IJob::EPriority m_Priority;
+
+	PathQueue   m_Paths;
+	ShadowQueue m_Shadows;
+	int m_WaveStart, m_WaveSize;
+
+	EStage m_NextStage;
+	uint64 m_StageStartTicks;
+	uint64 m_StageTicks[eStageCount];
+
+	bool   m_bSortHits, m_bSortRays;
+	int64  m_ShadowRays, m_ShadowNodes, m_ShadowNodesStart;  // traversal cost of the shadow stage, to compare sorted and unsorted rays
+
+	std::vector<KernelJob*> m_KernelJobs;
+	StageJob * m_pStageJob;
+};
+
+#endif
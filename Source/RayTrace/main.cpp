@@ -75,6 +75,7 @@ class MainWnd : public NanoCore::WindowMain, public IStatusCallback
 	const static int IDC_VIEW_PREVIEWMODE_SPECULAR = 1205;
 	const static int IDC_VIEW_PREVIEWMODE_BUMP = 1206;
 	const static int IDC_VIEW_OPTIONS = 1102;
+	const static int IDC_VIEW_SAMPLE_DENSITY = 1104;
 	const static int IDC_OPTIONS_OK = 1103;
 	const static int IDC_CAMERAS_FIRST = 2000;
 
@@ -117,6 +118,9 @@ class MainWnd : public NanoCore::WindowMain, public IStatusCallback
 public:
 	MainWnd() {
 		m_bInvalidate = false;
+		m_bShowPhoto = false;
+		m_bRestartPhoto = false;
+		m_bDrag = false;
 		m_State = STATE_PREVIEW;
 		m_PreviewResolution = 200;
 
@@ -127,16 +131,11 @@ public:
 
 		m_pScene = CreateKDTree( 8 );
 
+		// the preview renders a single pass per view, so the hits warped from the last view are traced again right after
+		m_Preview.m_bReprojection = true;
+
 		m_Options.push_back( NanoCore::KeyValuePtr( "Preview resolution", m_PreviewResolution ));
-		m_Options.push_back( NanoCore::KeyValuePtr( "Raytrace threads", m_Raytracer.m_NumThreads ));
-		m_Options.push_back( NanoCore::KeyValuePtr( "GI bounces", m_Environment.GIBounces ));
-		m_Options.push_back( NanoCore::KeyValuePtr( "GI samples", m_Environment.GISamples ));
-		m_Options.push_back( NanoCore::KeyValuePtr( "Sun samples", m_Environment.SunSamples ));
-		m_Options.push_back( NanoCore::KeyValuePtr( "Sun disk angle", m_Environment.SunDiskAngle ));
-		m_Options.push_back( NanoCore::KeyValuePtr( "Sun angle 1", m_Environment.SunAngle1 ));
-		m_Options.push_back( NanoCore::KeyValuePtr( "Sun angle 2", m_Environment.SunAngle2 ));
-		m_Options.push_back( NanoCore::KeyValuePtr( "Sun strength", m_Environment.SunStrength ));
-		m_Options.push_back( NanoCore::KeyValuePtr( "Sky strength", m_Environment.SkyStrength ));
+		m_Raytracer.GetOptions( m_Options, m_Environment );
 	}
 	~MainWnd() {
 	}
@@ -149,25 +148,26 @@ public:
 				} else {
 					if( m_State == STATE_PREVIEW && bDown ) {
 						m_State = STATE_RENDERING;
-						m_Image.Init( GetWidth(), GetHeight(), 24 );
-						m_Raytracer.Render( m_Camera, m_Image, m_pScene, m_Environment, &m_ShaderPreview, this );
-						m_strBottomHelpLine = "Press Esc to cancel the rendering";
+						ResizeImage( m_Image, GetWidth(), GetHeight() );
+						m_Raytracer.Render( m_Camera, m_Image, m_pScene, m_Environment, &m_ShaderPreview, this, 1, NanoCore::IJob::ePriorityInteractive );
+						m_strBottomHelpLine = "Press Esc to stop the rendering";
 					}
 				}
 				break;
 			case 13:
 				if( m_State == STATE_PREVIEW && bDown ) {
 					m_State = STATE_RENDERING;
-					m_Image.Init( GetWidth(), GetHeight(), 24 );
-					m_Raytracer.Render( m_Camera, m_Image, m_pScene, m_Environment, &m_ShaderPhoto, this );
-					m_strBottomHelpLine = "Press Esc to cancel the rendering";
+					RenderPhoto();
+					m_strBottomHelpLine = "Press Esc to stop the rendering";
 				}
 				break;
 			case 27:
 				if( m_State == STATE_RENDERING ) {
 					m_Raytracer.Stop();
 					m_State = STATE_PREVIEW;
-					m_bInvalidate = true;
+					m_bShowPhoto = !m_bRestartPhoto && m_Raytracer.GetPass() > 0;  // keep the image once at least one full pass is accumulated
+					m_bInvalidate = !m_bShowPhoto;
+					m_bRestartPhoto = false;
 					m_UpdateMs = 20;
 					SetStatus( NULL );
 				}
@@ -177,8 +177,10 @@ public:
 				break;
 		}
 	}
+	// the camera also moves while a photo is rendered: the raytracers render the copies taken when they started, OnUpdate
+	// previews the new view and renders the photo again
 	virtual void OnMouse( int x, int y, int btn_down, int btn_up, int btn_dblclick, int wheel ) {
-		if( m_State != STATE_PREVIEW )
+		if( m_State == STATE_LOADING )
 			return;
 
 		if( wheel ) {
@@ -187,46 +189,53 @@ public:
 			m_bInvalidate = true;
 		}
 
-		static bool bDrag = false;
 		static int dragX, dragY;
 		static Camera dragCam;
 
 		if( btn_down & 1 ) {
-			bDrag = true;
+			m_bDrag = true;
 			dragX = x;
 			dragY = y;
 			dragCam = m_Camera;
 		}
 		if( btn_up & 1 ) {
-			bDrag = false;
+			m_bDrag = false;
 		}
-		if( bDrag ) {
+		if( m_bDrag ) {
 			m_Camera = dragCam;
 			m_Camera.Rotate( DEG2RAD(y - dragY) * 0.5f, DEG2RAD(x - dragX) * 0.5f );
 			m_bInvalidate = true;
 		}
 		if( btn_down & 2 ) {
-			RightClick( x, y );
+			if( m_bCtrlKey )
+				CropRender( x, y );
+			else
+				RightClick( x, y );
 		}
 	}
 	virtual void OnSize( int w, int h ) {
 		if( !w || !h )
 			return;
 		if( m_Image.GetWidth() != w || m_Image.GetHeight() != h ) {
-			m_Raytracer.Stop();
-			m_Image.Init( m_PreviewResolution, m_PreviewResolution * h / w, 24 );
-			m_Image.Fill( 0x303540 );
+			m_Preview.Stop();
+			m_PreviewImage.Init( m_PreviewResolution, m_PreviewResolution * h / w, 24 );
+			m_PreviewImage.Fill( 0x303540 );
+			m_bShowPhoto = false;
 			m_bInvalidate = true;
 		}
 	}
 	virtual void OnDraw()
 	{
-		if( m_Image.GetWidth()) {
+		// a photo being rendered again for a new view shows the preview of the view until it starts over
+		const bool bPhoto = m_State == STATE_RENDERING ? !m_bRestartPhoto : m_bShowPhoto;
+		NanoCore::Image & image = bPhoto ? m_Image : m_PreviewImage;
+		if( image.GetWidth()) {
+			(bPhoto ? m_Raytracer : m_Preview).ResolveImage();
 
 			int percent = m_Raytracer.GetProgress();
 
-			if( percent > 95 || m_State == STATE_PREVIEW ) {
-				DrawImage( 0, 0, GetWidth(), GetHeight(), m_Image.GetImageAt(0,0), m_Image.GetWidth(), m_Image.GetHeight(), 24 );
+			if( percent > 95 || !bPhoto || m_State == STATE_PREVIEW ) {
+				DrawImage( 0, 0, GetWidth(), GetHeight(), image.GetImageAt(0,0), image.GetWidth(), image.GetHeight(), 24 );
 			} else {
 				static int lastWidth = 0;
 				percent = Max( percent, 1 );
@@ -258,6 +267,7 @@ public:
 		switch( m_State ) {
 			case STATE_LOADING:
 				if( ! m_LoadingThread.IsRunning()) {
+					m_Preview.ShareScene( m_Raytracer );
 					CenterCamera();
 					m_State = STATE_PREVIEW;
 					m_UpdateMs = 100;
@@ -265,28 +275,31 @@ public:
 				break;
 			case STATE_PREVIEW:
 				if( m_bInvalidate ) {
-					if( m_Image.GetWidth() != m_PreviewResolution ) {
-						m_Image.Init( m_PreviewResolution, m_PreviewResolution * GetHeight() / GetWidth(), 24 );
-					}
-					m_Raytracer.Render( m_Camera, m_Image, m_pScene, m_Environment, &m_ShaderPreview, this );
+					RenderPreview();
 					m_bInvalidate = false;
+				} else if( m_Preview.GetReprojectedPixels() && !m_Preview.IsRendering() ) {
+					// the camera stopped moving, trace the pixels that were only warped from the previous frame
+					RenderPreview();
 				}
 				Redraw();
 				break;
 
 			case STATE_RENDERING:
-				if( m_Raytracer.IsRendering()) {
-					Redraw();
-				} else {
-					if( m_bInvalidate ) {
-						m_bInvalidate = false;
-						m_Raytracer.Render( m_Camera, m_Image, m_pScene, m_Environment, &m_ShaderPhoto, this );
-					} else {
-						m_State = STATE_PREVIEW;
-						m_UpdateMs = 20;
-						SetStatus( NULL );
-					}
+				if( m_bInvalidate ) {
+					// the preview jobs are picked ahead of the ones of the photo, which is started again once the camera stops
+					m_bInvalidate = false;
+					m_bRestartPhoto = true;
+					RenderPreview();
+				} else if( m_bRestartPhoto && !m_bDrag && !m_Preview.IsRendering() ) {
+					m_bRestartPhoto = false;
+					RenderPhoto();
+				} else if( !m_bRestartPhoto && !m_Raytracer.IsRendering() ) {
+					m_State = STATE_PREVIEW;
+					m_bShowPhoto = true;
+					m_UpdateMs = 20;
+					SetStatus( NULL );
 				}
+				Redraw();
 				break;
 		}
 	}
@@ -311,10 +324,12 @@ public:
 				AddMenuItem( previewMenu, L"Diffuse map", IDC_VIEW_PREVIEWMODE_DIFFUSE );
 				AddMenuItem( previewMenu, L"Specular map", IDC_VIEW_PREVIEWMODE_SPECULAR );
 				AddMenuItem( previewMenu, L"Bump map", IDC_VIEW_PREVIEWMODE_BUMP );
+			AddMenuItem( viewMenu, L"Sample density", IDC_VIEW_SAMPLE_DENSITY );
 			AddMenuItem( viewMenu, L"Options", IDC_VIEW_OPTIONS );
 		AddSubmenu( mainMenu, L"Cameras", m_CamerasMenu );
 	}
 	virtual void OnQuit() {
+		m_Preview.Stop();
 		m_Raytracer.Stop();
 	}
 	virtual void OnMenu( int id ) {
@@ -329,6 +344,7 @@ public:
 				SaveImage();
 				break;
 			case IDC_FILE_EXIT:
+				m_Preview.Stop();
 				m_Raytracer.Stop();
 				Exit();
 				break;
@@ -345,8 +361,12 @@ public:
 				m_pOptionsDialog->Show( L"Options" );
 				break;
 			}
+			case IDC_VIEW_SAMPLE_DENSITY:
+				m_Raytracer.ShowSampleDensity( !m_Raytracer.IsShowingSampleDensity() );
+				break;
 			case IDC_OPTIONS_OK:
-				m_Image.Init( m_PreviewResolution, m_PreviewResolution * GetHeight() / GetWidth(), 24 );
+				// the camera and the scene are unchanged, so re-rendering only re-shades the cached primary hits
+				m_bInvalidate = true;
 				Serialize( m_wFile + L".xml", eSave );
 				break;
 			case IDC_VIEW_PREVIEWMODE_COLOREDCUBE:
@@ -383,7 +403,20 @@ public:
 			m_Raytracer.m_SelectedTriangle = -1;
 			m_strBottomHelpLine = "Nothing there";
 		}
-		m_bInvalidate = true;
+		if( m_State == STATE_PREVIEW )
+			m_bInvalidate = true;
+	}
+	// re-renders a window around the cursor, the rest of the last photo of the same view keeps its samples
+	void CropRender( int x, int y ) {
+		const int half = 128;
+		m_Raytracer.Stop();
+		ResizeImage( m_Image, GetWidth(), GetHeight() );
+		y = GetHeight() - y;
+		m_Raytracer.SetCropRegion( x - half, y - half, x + half, y + half );
+		m_State = STATE_RENDERING;
+		m_bRestartPhoto = false;
+		m_Raytracer.Render( m_Camera, m_Image, m_pScene, m_Environment, &m_ShaderPhoto, this, 0, NanoCore::IJob::ePriorityBackground );
+		m_strBottomHelpLine = "Press Esc to stop the rendering";
 	}
 	void AddCurrentCamera() {
 		wchar_t w[128];
@@ -393,6 +426,7 @@ public:
 		Serialize( m_wFile + L".xml", eSave );
 	}
 	void LoadModel() {
+		m_Preview.Stop();
 		std::wstring wFolder = NanoCore::GetExecutableFolder();
 		std::wstring wFile = ChooseFile( wFolder.c_str(), L"Wavefront object files (*.obj)\0*.obj\0", L"Load model", true );
 		if( !wFile.empty()) {
@@ -409,10 +443,35 @@ public:
 			Serialize( m_wFile + L".xml", eLoad );
 		}
 	}
+	// photos are queued in the background lane, behind the preview of a moving camera
+	void RenderPhoto() {
+		m_Raytracer.Stop();
+		ResizeImage( m_Image, GetWidth(), GetHeight() );
+		if( m_Raytracer.m_UseWavefront )
+			m_Raytracer.RenderWavefront( m_Camera, m_Image, m_pScene, m_Environment, &m_ShaderPhoto, this, 0, NanoCore::IJob::ePriorityBackground );
+		else
+			m_Raytracer.Render( m_Camera, m_Image, m_pScene, m_Environment, &m_ShaderPhoto, this, 0, NanoCore::IJob::ePriorityBackground );
+	}
+	// the preview uses the workers of the photos, so they are not replaced back and forth
+	void RenderPreview() {
+		m_Preview.m_NumThreads = m_Raytracer.m_NumThreads;
+		m_Preview.m_ThreadAffinity = m_Raytracer.m_ThreadAffinity;
+		ResizeImage( m_PreviewImage, m_PreviewResolution, m_PreviewResolution * GetHeight() / GetWidth() );
+		m_Preview.Render( m_Camera, m_PreviewImage, m_pScene, m_Environment, &m_ShaderPreview, this, 1, NanoCore::IJob::ePriorityInteractive );
+		m_bShowPhoto = false;
+	}
+	// the raytracer keeps the image of an unchanged view as a starting point, so it is only reallocated on resize
+	void ResizeImage( NanoCore::Image & image, int w, int h ) {
+		if( image.GetWidth() != w || image.GetHeight() != h ) {
+			image.Init( w, h, 24 );
+			image.Fill( 0 );
+		}
+	}
 	void SaveImage() {
 		std::wstring wFolder = NanoCore::GetCurrentFolder();
 		std::wstring wFile = ChooseFile( wFolder.c_str(), L"Bitmap(*.bmp)\0*.bmp\0", L"Save image", false );
 		if( !wFile.empty()) {
+			m_Raytracer.ResolveImage();
 			m_Image.WriteAsBMP( wFile.c_str() );
 		}
 	}
@@ -439,18 +498,15 @@ public:
 			m_strStatus = buf;
 		}
 	}
+	virtual bool Confirm( const wchar_t * pwQuestion ) {
+		return MsgBox( L"Warning", pwQuestion, true );
+	}
 	void CenterCamera() {
 		if( m_pScene->IsEmpty())
 			return;
 
 		AABB box = m_pScene->GetAABB();
-
-		float3 center = (box.min + box.max) * 0.5f;
-		float L = len( box.min - center );
-
-		m_Camera.fovy = 60.0f;
-		m_Camera.world_up = float3(0,1,0);
-		m_Camera.LookAt( center, float3(1,-1,-1)*L );
+		m_Camera.Frame( box.min, box.max );
 		m_bInvalidate = true;
 	}
 
@@ -459,10 +515,14 @@ public:
 	std::string     m_strStatus, m_strBottomHelpLine;
 	LoadingThread   m_LoadingThread;
 	IScene*         m_pScene;
-	NanoCore::Image m_Image, m_LowresImage;
+	NanoCore::Image m_Image, m_LowresImage, m_PreviewImage;
 	Camera          m_Camera;
-	Raytracer       m_Raytracer;
+	Raytracer       m_Raytracer;        // photos and full resolution renderings
+	Raytracer       m_Preview;          // the interactive preview, rendered next to them
 	bool            m_bInvalidate;
+	bool            m_bShowPhoto;       // the preview state keeps showing the last photo until the view changes
+	bool            m_bRestartPhoto;    // the view changed while a photo was rendered, it is rendered again once the camera stops
+	bool            m_bDrag;
 	EState          m_State;
 	int             m_CamerasMenu;
 	std::vector<Camera> m_Cameras;
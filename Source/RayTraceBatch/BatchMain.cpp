@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <math.h>
+#include <NanoCore/Threads.h>
+#include <NanoCore/File.h>
+#include <NanoCore/Serialize.h>
+#include <NanoCore/String.h>
+#include <NanoCore/Image.h>
+#include <RayTrace/Common.h>
+#include <RayTrace/RayTracer.h>
+#include <RayTrace/ShaderPhoto.h>
+
+
+
+/*
+	Headless renderer: loads a model and the scene file saved next to it by the viewer (cameras and environment),
+	renders every camera with the photo shader and writes one bitmap per camera plus a JSON timing report. Next to each
+	bitmap, the mean of the samples of every pixel is written as a portable float map (.pfm), before any tonemapping.
+
+	RayTraceBatch <model.obj> [options]
+	  -scene  <file.xml>   scene file, <model>.xml by default
+	  -out    <folder>     folder of the images and of the report, the model folder by default
+	  -report <file.json>  timing report, <out>/<model>_report.json by default
+	  -width  <pixels>     1280 by default
+	  -height <pixels>     720 by default
+	  -passes <count>      progressive passes per camera, 16 by default, 0 renders until the budgets of the scene file
+	  -time   <seconds>    time budget per camera, overrides the scene file and implies -passes 0
+	  -cache               writes the binary OBJ and KD-tree caches instead of skipping them
+	  -reference <folder>  output of an earlier run with the same names, the report gets the RMSE against its .pfm files
+	  -sweep               renders each camera with 1, 2, 4... up to -passes passes, for convergence curves
+
+	RMSE against passes (each pass adds the GI samples of the scene file once) is measured by rendering a reference
+	with many passes, then sweeping the same cameras against it, the report lists one entry per pass count:
+	  RayTraceBatch model.obj -passes 1024 -out ref
+	  RayTraceBatch model.obj -passes 64 -sweep -reference ref
+*/
+
+
+
+class ConsoleStatus : public IStatusCallback {
+public:
+	ConsoleStatus( bool bCache ) : m_bCache(bCache) {}
+
+	virtual void SetStatus( const char * pcFormat, ... ) {
+		if( !pcFormat )
+			return;
+		char buf[256];
+		va_list args;
+		va_start( args, pcFormat );
+		vsprintf_s( buf, pcFormat, args );
+		va_end( args );
+		printf( "\r%-79s", buf );
+	}
+	virtual bool Confirm( const wchar_t * pwQuestion ) {
+		return m_bCache;
+	}
+
+private:
+	bool m_bCache;
+};
+
+
+
+static float SecondsSince( uint64 ticks ) {
+	return float( NanoCore::TickToMicroseconds( NanoCore::GetTicks() - ticks )) * 0.000001f;
+}
+
+static std::string JsonString( const std::wstring & w ) {
+	std::string s = NanoCore::StrWcsToMbs( w.c_str() ), r;
+	for( size_t i=0; i<s.size(); ++i ) {
+		if( s[i] == '\\' || s[i] == '"' )
+			r += '\\';
+		r += s[i];
+	}
+	return r;
+}
+
+static bool LoadScene( const std::wstring & wFile, std::vector<NanoCore::KeyValuePtr> & options, std::vector<Camera> & cameras ) {
+	NanoCore::IFile::Ptr fp = NanoCore::FS::Open( wFile.c_str(), NanoCore::FS::efRead );
+	if( !fp )
+		return false;
+
+	NanoCore::TextFile tf( fp );
+	NanoCore::XmlNode * scene = new NanoCore::XmlNode( "Scene" );
+	scene->Load( tf );
+	NanoCore::Serialize( scene, "Environment", options );
+	NanoCore::Serialize( scene, "Cameras", cameras );
+	delete scene;
+	return true;
+}
+
+// little endian RGB floats, the bottom row first like the frame buffer
+static bool WritePFM( const FrameBuffer & fb, const std::wstring & wFile ) {
+	NanoCore::IFile::Ptr fp = NanoCore::FS::Open( wFile.c_str(), NanoCore::FS::efWriteTrunc );
+	if( !fp )
+		return false;
+	char header[64];
+	int size = sprintf_s( header, "PF\n%d %d\n-1.0\n", fb.GetWidth(), fb.GetHeight() );
+	fp->Write( header, size );
+	std::vector<float3> row( fb.GetWidth() );
+	for( int y=0; y<fb.GetHeight(); ++y ) {
+		for( int x=0; x<fb.GetWidth(); ++x )
+			row[x] = fb.GetColor( x, y );
+		fp->Write( &row[0], uint32( row.size() * sizeof(float3) ));
+	}
+	return true;
+}
+
+static bool ReadPFM( const std::wstring & wFile, int & width, int & height, std::vector<float3> & pixels ) {
+	NanoCore::IFile::Ptr fp = NanoCore::FS::Open( wFile.c_str(), NanoCore::FS::efRead );
+	if( !fp )
+		return false;
+	std::string header;
+	for( int lines=0; lines<3; ) {
+		char c;
+		if( fp->Read( &c, 1 ) != 1 )
+			return false;
+		header += c;
+		lines += c == '\n' ? 1 : 0;
+	}
+	float scale = 0.0f;
+	if( sscanf( header.c_str(), "PF %d %d %f", &width, &height, &scale ) != 3 || width <= 0 || height <= 0 || scale >= 0.0f )
+		return false;
+	pixels.resize( width * height );
+	const uint32 size = uint32( pixels.size() * sizeof(float3) );
+	return fp->Read( &pixels[0], size ) == size;
+}
+
+// root mean square of the channel differences of the mean radiance of the pixels, -1 when they cannot be compared;
+// the frame buffer is compared before tonemapping, so the error of the bright pixels is not clamped away
+static float FrameBufferRMSE( const FrameBuffer & fb, const std::wstring & wReference ) {
+	int width, height;
+	std::vector<float3> reference;
+	if( !ReadPFM( wReference, width, height, reference ) || width != fb.GetWidth() || height != fb.GetHeight() )
+		return -1.0f;
+
+	double sum = 0.0;
+	for( int y=0; y<height; ++y )
+		for( int x=0; x<width; ++x ) {
+			float3 d = fb.GetColor( x, y ) - reference[x + y*width];
+			sum += double( d.x*d.x ) + double( d.y*d.y ) + double( d.z*d.z );
+		}
+	return float( sqrt( sum / double( 3 * width * height )));
+}
+
+static std::wstring ImageName( const std::wstring & wName, int camera, int passes, bool bSweep, const wchar_t * pwExt ) {
+	wchar_t w[64];
+	if( bSweep )
+		swprintf( w, 64, L"_camera%d_%dp.%ls", camera, passes, pwExt );
+	else
+		swprintf( w, 64, L"_camera%d.%ls", camera, pwExt );
+	return wName + w;
+}
+
+static int Usage() {
+	printf( "usage: RayTraceBatch <model.obj> [-scene file.xml] [-out folder] [-report file.json] [-width w] [-height h] [-passes n] [-time seconds] [-cache]"
+		" [-reference folder] [-sweep]\n" );
+	return 1;
+}
+
+
+
+struct CameraReport {
+	int    camera;
+	float  seconds;
+	int64  rays;
+	float  samplesPerPixel;
+	int    passes;
+	float  fetchesPerHit;
+	float  rmse;
+	std::wstring wImage;
+};
+
+int wmain( int argc, wchar_t ** argv )
+{
+	std::wstring wModel, wScene, wOut, wReport, wReference;
+	int   width = 1280, height = 720, passes = 16;
+	float timeBudget = 0.0f;
+	bool  bCache = false, bSweep = false;
+
+	for( int i=1; i<argc; ++i ) {
+		std::wstring arg = argv[i];
+		bool bValue = i+1 < argc;
+		if( arg == L"-cache" )
+			bCache = true;
+		else if( arg == L"-sweep" )
+			bSweep = true;
+		else if( arg == L"-reference" && bValue )
+			wReference = argv[++i];
+		else if( arg == L"-scene" && bValue )
+			wScene = argv[++i];
+		else if( arg == L"-out" && bValue )
+			wOut = argv[++i];
+		else if( arg == L"-report" && bValue )
+			wReport = argv[++i];
+		else if( arg == L"-width" && bValue )
+			width = _wtoi( argv[++i] );
+		else if( arg == L"-height" && bValue )
+			height = _wtoi( argv[++i] );
+		else if( arg == L"-passes" && bValue )
+			passes = _wtoi( argv[++i] );
+		else if( arg == L"-time" && bValue )
+			timeBudget = (float)_wtof( argv[++i] );
+		else if( arg[0] != L'-' && wModel.empty() )
+			wModel = arg;
+		else
+			return Usage();
+	}
+	if( wModel.empty() || width <= 0 || height <= 0 || passes < 0 )
+		return Usage();
+
+	std::wstring wBase = wModel;
+	size_t p = wBase.find_last_of( L'.' );
+	if( p != std::wstring::npos )
+		wBase.erase( p );
+	std::wstring wName = NanoCore::StrGetFilename( wBase );
+	if( wScene.empty() )
+		wScene = wBase + L".xml";
+	if( wOut.empty() )
+		wOut = NanoCore::StrGetPath( wBase );
+	if( !wOut.empty() && wOut[wOut.size()-1] != L'\\' && wOut[wOut.size()-1] != L'/' )
+		wOut += L'\\';
+	if( wReport.empty() )
+		wReport = wOut + wName + L"_report.json";
+	if( !wReference.empty() && wReference[wReference.size()-1] != L'\\' && wReference[wReference.size()-1] != L'/' )
+		wReference += L'\\';
+
+	ConsoleStatus status( bCache );
+	Raytracer     raytracer;
+	Environment   env;
+	ShaderPhoto   shader;
+	std::vector<NanoCore::KeyValuePtr> options;
+	std::vector<Camera> cameras;
+
+	raytracer.GetOptions( options, env );
+	bool bSceneFile = LoadScene( wScene, options, cameras );
+	if( timeBudget > 0.0f ) {
+		raytracer.m_TimeBudget = timeBudget;
+		passes = 0;
+	}
+	if( !passes && raytracer.m_TimeBudget <= 0.0f && raytracer.m_RayBudget <= 0 ) {
+		printf( "-passes 0 needs a time or ray budget\n" );
+		return 1;
+	}
+	if( !passes && bSweep ) {
+		printf( "-sweep needs a pass count\n" );
+		return 1;
+	}
+
+	// loading
+	uint64 t0 = NanoCore::GetTicks();
+	ISceneLoader * pLoader = CreateObjLoader();
+	if( !pLoader->Load( wModel.c_str(), &status )) {
+		printf( "\ncannot load %s\n", NanoCore::StrWcsToMbs( wModel.c_str() ).c_str() );
+		delete pLoader;
+		return 1;
+	}
+	float loadSeconds = SecondsSince( t0 );
+
+	t0 = NanoCore::GetTicks();
+	IScene * pScene = CreateKDTree( 8 );
+	pScene->Build( pLoader, &status );
+	float buildSeconds = SecondsSince( t0 );
+
+	t0 = NanoCore::GetTicks();
+	raytracer.LoadMaterials( pLoader, &status );
+	float materialSeconds = SecondsSince( t0 );
+	delete pLoader;
+
+	if( cameras.empty() ) {
+		AABB box = pScene->GetAABB();
+		Camera camera;
+		camera.Frame( box.min, box.max );
+		cameras.push_back( camera );
+	}
+	printf( "\rloaded in %0.2fs, KD-tree in %0.2fs, materials in %0.2fs, %d camera(s)%s\n", loadSeconds, buildSeconds, materialSeconds,
+		int(cameras.size()), bSceneFile ? "" : ", no scene file" );
+
+	// rendering
+	NanoCore::Image image;
+	image.Init( width, height, 24 );
+	std::vector<CameraReport> reports;
+	float totalSeconds = 0.0f;
+
+	for( size_t i=0; i<cameras.size(); ++i )
+	for( int n = bSweep ? 1 : passes;; n = Min( n*2, passes )) {
+		image.Fill( 0 );
+		// the primary hits of the previous rendering of the camera are traced again, so each report counts all its rays
+		raytracer.InvalidateGBuffer();
+		if( raytracer.m_UseWavefront )
+			raytracer.RenderWavefront( cameras[i], image, pScene, env, &shader, &status, n );
+		else
+			raytracer.Render( cameras[i], image, pScene, env, &shader, &status, n );
+		while( raytracer.IsRendering() )
+			NanoCore::Sleep( 10 );
+
+		reports.push_back( CameraReport() );
+		CameraReport & r = reports.back();
+		r.camera = int(i+1);
+		r.seconds = raytracer.GetRenderSeconds();
+		RayStats stats;
+		raytracer.GetRenderStats( stats );
+		r.rays = stats.GetRays();
+		r.samplesPerPixel = raytracer.GetSamplesPerPixel();
+		r.fetchesPerHit = float( stats.Get( RayStats::eTextureFetches )) / float( Max( stats.Get( RayStats::eShadedHits ), int64(1) ));
+		r.passes = raytracer.GetCompletedPasses();
+		totalSeconds += r.seconds;
+
+		r.wImage = wOut + ImageName( wName, r.camera, n, bSweep, L"bmp" );
+		raytracer.ResolveImage();
+		if( !image.WriteAsBMP( r.wImage.c_str() ))
+			printf( "\ncannot write %s\n", NanoCore::StrWcsToMbs( r.wImage.c_str() ).c_str() );
+		std::wstring wFloats = wOut + ImageName( wName, r.camera, n, bSweep, L"pfm" );
+		if( !WritePFM( raytracer.m_FrameBuffer, wFloats ))
+			printf( "\ncannot write %s\n", NanoCore::StrWcsToMbs( wFloats.c_str() ).c_str() );
+		r.rmse = wReference.empty() ? -1.0f : FrameBufferRMSE( raytracer.m_FrameBuffer, wReference + ImageName( wName, r.camera, 0, false, L"pfm" ));
+
+		printf( "\rcamera %d: %d passes, %0.2fs, %0.2f Mrays/s, %0.1f spp", r.camera, r.passes, r.seconds, r.seconds > 0.0f ? r.rays / r.seconds * 0.000001f : 0.0f,
+			r.samplesPerPixel );
+		if( r.rmse >= 0.0f )
+			printf( ", RMSE %0.5f", r.rmse );
+		printf( "%-20s\n", "" );
+		raytracer.PrintStats();
+
+		if( n == passes )
+			break;
+	}
+
+	// report
+	NanoCore::IFile::Ptr fp = NanoCore::FS::Open( wReport.c_str(), NanoCore::FS::efWriteTrunc );
+	if( fp ) {
+		NanoCore::TextFile tf( fp );
+		tf.Write( "{\n" );
+		tf.Write( "\t\"model\": \"%s\",\n", JsonString( wModel ).c_str() );
+		tf.Write( "\t\"width\": %d,\n\t\"height\": %d,\n\t\"threads\": %d,\n", width, height, raytracer.m_NumThreads );
+		tf.Write( "\t\"load_seconds\": %0.3f,\n\t\"build_seconds\": %0.3f,\n\t\"materials_seconds\": %0.3f,\n", loadSeconds, buildSeconds, materialSeconds );
+		tf.Write( "\t\"render_seconds\": %0.3f,\n", totalSeconds );
+		if( const PhotonMap * pPhotons = raytracer.GetPhotonMap() )
+			tf.Write( "\t\"photon_map_seconds\": %0.3f,\n\t\"photon_map_photons\": %d,\n\t\"photon_map_kb\": %d,\n", pPhotons->GetBuildSeconds(),
+				pPhotons->GetPhotonCount(), int( pPhotons->GetMemoryUsage() / 1024 ));
+		tf.Write( "\t\"cameras\": [\n" );
+		for( size_t i=0; i<reports.size(); ++i ) {
+			const CameraReport & r = reports[i];
+			tf.Write( "\t\t{ \"camera\": %d, \"image\": \"%s\", \"seconds\": %0.3f, \"passes\": %d, \"rays\": %lld, \"mrays_per_second\": %0.3f, \"samples_per_pixel\": %0.3f, "
+				"\"texture_fetches_per_hit\": %0.2f", r.camera, JsonString( r.wImage ).c_str(), r.seconds, r.passes, r.rays, r.seconds > 0.0f ? r.rays / r.seconds * 0.000001f : 0.0f,
+				r.samplesPerPixel, r.fetchesPerHit );
+			if( r.rmse >= 0.0f )
+				tf.Write( ", \"rmse\": %0.6f", r.rmse );
+			tf.Write( " }%s\n", i+1 < reports.size() ? "," : "" );
+		}
+		tf.Write( "\t]\n}\n" );
+	} else {
+		printf( "cannot write %s\n", NanoCore::StrWcsToMbs( wReport.c_str() ).c_str() );
+	}
+
+	delete pScene;
+	return 0;
+}